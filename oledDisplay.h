@@ -1,6 +1,12 @@
-// Matrix mapped to ascii table for each caracter to be displayed on the Oled
+// Glyph atlas for the Oled, 8 column bytes per character in the column order of the display
+// (the font is stored mirrored for the rotated mounting). All 256 byte values have a glyph so
+// any received byte can index it, 0x80 - 0xFF have no glyph in the font and are drawn as a box.
 
-char oledAsciiMatrix[][8] = {{0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+#define OLED_CELL_SIZE 8    // Bytes of a glyph, one per pixel column
+#define OLED_COLUMNS 16     // Characters on a line of the display
+
+static const unsigned char oledGlyphAtlas[256][OLED_CELL_SIZE] __attribute__((aligned(16))) = {
+{0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
 {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
 {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
 {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
@@ -127,4 +133,159 @@ char oledAsciiMatrix[][8] = {{0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
 {0x00, 0x00, 0x00, 0x00, 0x7f, 0x00, 0x00, 0x00 },
 {0x00, 0x00, 0x08, 0x36, 0x41, 0x00, 0x00, 0x00 },
 {0x00, 0x18, 0x10, 0x10, 0x08, 0x08, 0x18, 0x00 },
-{0x55, 0xaa, 0x55, 0xaa, 0x55, 0xaa, 0x55, 0xaa }};
\ No newline at end of file
+{0x55, 0xaa, 0x55, 0xaa, 0x55, 0xaa, 0x55, 0xaa },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 },
+{0x00, 0x7f, 0x41, 0x41, 0x41, 0x41, 0x7f, 0x00 }};
+
+// Two glyph cells, stored with a single unaligned 16 byte move (SSE2 / NEON)
+typedef unsigned char oledCellPair __attribute__((vector_size(16), aligned(1)));
+
+/**
+ * Function: oled_blit_row
+ * ----------------------------
+ *  Render a line of 16 characters into its 128 byte page. The display is mounted rotated so the
+ *  first character goes to the last cell, the cells are written two at a time in 16 byte moves.
+ *      @param[out] page Page of the line, 128 bytes
+ *      @param[in] text The 16 characters of the line
+ */
+
+static inline void oled_blit_row(char* page, const unsigned char* text) {
+
+    for(int cell = 0; cell < OLED_COLUMNS; cell += 2) {
+
+        union {
+            unsigned long long glyph[2];
+            oledCellPair pair;
+        } cells;
+
+        memcpy(&cells.glyph[0], oledGlyphAtlas[text[OLED_COLUMNS - 1 - cell]], OLED_CELL_SIZE);
+        memcpy(&cells.glyph[1], oledGlyphAtlas[text[OLED_COLUMNS - 2 - cell]], OLED_CELL_SIZE);
+        *(oledCellPair*)(page + cell * OLED_CELL_SIZE) = cells.pair;
+    }
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "oledDisplay.h"
+
+/**
+ * Microbenchmark of the OLED line rendering, both variants render full 512 byte frames of
+ * 4 lines of 16 characters: the nested loop the receive thread used to run against oled_blit_row.
+ */
+#define DEFAULT_FRAMES 2000000
+#define TEXT_SIZE 4096
+
+/**
+ * Function: render_nested_loop
+ * ----------------------------
+ *  The former renderer, walks every line backwards and copies one glyph at a time.
+ *      @param[in] text The 64 characters of the frame
+ *      @param[out] frame OLED frame of 512 bytes
+ */
+
+void render_nested_loop(const unsigned char* text, char* frame) {
+
+    int count = 0;
+
+    for(int i = 15; i < 64; i += 16) {
+        for(int j = i; j > i - 16; j--) {
+            memcpy(frame + (count*8), oledGlyphAtlas[text[j]], 8);
+            count++;
+        }
+    }
+}
+
+/**
+ * Function: render_blit
+ * ----------------------------
+ *  The same frame with oled_blit_row, one call per line.
+ *      @param[in] text The 64 characters of the frame
+ *      @param[out] frame OLED frame of 512 bytes
+ */
+
+void render_blit(const unsigned char* text, char* frame) {
+
+    for(int line = 0; line < 4; line++)
+        oled_blit_row(frame + line * OLED_COLUMNS * OLED_CELL_SIZE, text + line * OLED_COLUMNS);
+}
+
+/**
+ * Function: run
+ * ----------------------------
+ *  Time a renderer over the given number of frames, every frame starts at another offset of the text.
+ * 
+ *      @return Nanoseconds per frame
+ */
+
+double run(void (*render)(const unsigned char*, char*), const unsigned char* text, char* frame, long frames) {
+
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < frames; i++) {
+        render(text + (i & (TEXT_SIZE - 64 - 1)), frame);
+        __asm__ volatile("" : : "r"(frame) : "memory"); // The frame has to be really written
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / frames;
+}
+
+int main(int argc, char* argv[]) {
+
+    long frames = argc > 1 ? atol(argv[1]) : DEFAULT_FRAMES;
+    static unsigned char text[TEXT_SIZE];
+    static char nested_frame[512], blit_frame[512];
+
+    srand(1);
+    for(int i = 0; i < TEXT_SIZE; i++)
+        text[i] = rand() & 0xFF;
+
+    /** Both renderers must produce the same frame */
+
+    for(int offset = 0; offset < TEXT_SIZE - 64; offset += 61) {
+        render_nested_loop(text + offset, nested_frame);
+        render_blit(text + offset, blit_frame);
+        if(memcmp(nested_frame, blit_frame, sizeof(nested_frame))) {
+            printf("Error: oled_blit_row renders another frame than the nested loop at offset %d!\n", offset);
+            return -1;
+        }
+    }
+
+    double nested_ns = run(render_nested_loop, text, nested_frame, frames);
+    double blit_ns = run(render_blit, text, blit_frame, frames);
+
+    printf("%ld frames of 4x16 characters\n", frames);
+    printf("nested loop:   %7.1f ns/frame\n", nested_ns);
+    printf("oled_blit_row: %7.1f ns/frame (%.2fx)\n", blit_ns, nested_ns / blit_ns);
+    return 0;
+}
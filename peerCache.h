@@ -0,0 +1,325 @@
+// Cache of the peers found by inquiry scans, so a connect by name or address prefix does not
+// need a scan of its own. The file is a header and up to PEER_CACHE_CAPACITY fixed records,
+// it is read whole into memory and replaced by a rename, a reader never sees half a write.
+// Every record carries the wall clock time the peer was last seen; peers older than the TTL
+// are skipped by the lookups and dropped at the next save.
+
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define PEER_CACHE_MAGIC "BTPEERS1"
+#define PEER_CACHE_VERSION 1
+#define PEER_CACHE_CAPACITY 256     // The oldest peer makes room for a new one
+#define PEER_NAME_SIZE 32           // Longer remote names are cut
+#define PEER_RSSI_UNKNOWN 0         // Measured values are negative
+
+struct peer_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+};
+
+struct peer {
+    uint64_t address;               // 48 bits, the first byte of the printed address highest
+    int64_t seen;                   // CLOCK_REALTIME seconds of the last scan that found it
+    uint32_t cod;                   // Class of device
+    int32_t rssi;                   // dBm, PEER_RSSI_UNKNOWN unless the scan measured it
+    char name[PEER_NAME_SIZE];      // Empty unless the scan asked for the names
+};
+
+struct peer_cache {
+    uint32_t count;
+    struct peer peers[PEER_CACHE_CAPACITY];
+};
+
+/**
+ * Function: peer_address_parse
+ * ----------------------------
+ *  Pack an address of 12 hex digits, the digits may be separated by ':' or '-'.
+ *      @param[in] text Address, ends at the first character that is neither
+ *      @param[out] address Packed address
+ *
+ *      @return Number of characters taken, 0 unless there were exactly 12 digits
+ */
+
+static inline int peer_address_parse(const char* text, uint64_t* address) {
+
+    int digits = 0, i = 0;
+
+    *address = 0;
+    for(; text[i]; i++) {
+        if(isxdigit((unsigned char)text[i]) && digits < 12) {
+            *address = *address << 4 | (isdigit((unsigned char)text[i]) ? text[i] - '0' : (toupper((unsigned char)text[i]) - 'A' + 10));
+            digits++;
+        }
+        else if((text[i] == ':' || text[i] == '-') && digits > 0 && digits % 2 == 0 && digits < 12)
+            continue;
+        else
+            break;
+    }
+    return digits == 12 ? i : 0;
+}
+
+/**
+ * Function: peer_address_format
+ * ----------------------------
+ *  Print a packed address as the module takes it, 12 hex digits without separators.
+ *      @param[in] address Packed address
+ *      @param[out] text 13 bytes
+ */
+
+static inline void peer_address_format(uint64_t address, char* text) {
+
+    snprintf(text, 13, "%012llX", (unsigned long long)(address & 0xFFFFFFFFFFFFull));
+}
+
+/**
+ * Function: peer_parse_result
+ * ----------------------------
+ *  Parse a result line of an inquiry. I answers address,COD, IN address,name,COD and IQ
+ *  address,COD,RSSI; the RSSI is taken as signed decimal or as the hex byte of the module.
+ *      @param[in] line Response line without the <cr><lf>
+ *      @param[out] peer Found peer, seen is left to the caller
+ *
+ *      @return 1 if the line was a result and 0 for the other lines of the inquiry
+ */
+
+static inline int peer_parse_result(const char* line, struct peer* peer) {
+
+    const char* fields[3];
+    int lengths[3], count = 0;
+
+    memset(peer, 0, sizeof(*peer));
+
+    if(peer_address_parse(line, &peer->address) != 12 || (line[12] != ',' && line[12] != 0))
+        return 0;
+
+    for(const char* field = line + 12; *field == ',' && count < 3; count++) {
+        fields[count] = ++field;
+        while(*field && *field != ',')
+            field++;
+        lengths[count] = field - fields[count];
+    }
+
+    /** A class of device has 4 - 6 hex digits, the RSSI at most 2 */
+
+    int cod_field = -1, name_field = -1, rssi_field = -1;
+    if(count == 1)
+        cod_field = 0;
+    else if(count == 2 && lengths[1] >= 4 && (int)strspn(fields[1], "0123456789abcdefABCDEF") >= lengths[1])
+        name_field = 0, cod_field = 1;
+    else if(count == 2)
+        cod_field = 0, rssi_field = 1;
+    else if(count == 3)
+        name_field = 0, cod_field = 1, rssi_field = 2;
+
+    if(cod_field >= 0)
+        peer->cod = strtoul(fields[cod_field], NULL, 16);
+    if(name_field >= 0) {
+        int size = lengths[name_field] < PEER_NAME_SIZE - 1 ? lengths[name_field] : PEER_NAME_SIZE - 1;
+        memcpy(peer->name, fields[name_field], size);
+        peer->name[size] = 0;
+    }
+    if(rssi_field >= 0)
+        peer->rssi = fields[rssi_field][0] == '-' ? atoi(fields[rssi_field]) : (int8_t)strtoul(fields[rssi_field], NULL, 16);
+    return 1;
+}
+
+/**
+ * Function: peer_cache_load
+ * ----------------------------
+ *  Read the cache file, a missing file is an empty cache.
+ *      @param[out] cache Cache
+ *      @param[in] path Cache file
+ *
+ *      @return 0 on success and -1 on error, errno is kept
+ */
+
+static inline int peer_cache_load(struct peer_cache* cache, const char* path) {
+
+    struct peer_cache_header header;
+    int fd = open(path, O_RDONLY);
+
+    cache->count = 0;
+    if(fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    ssize_t size = read(fd, &header, sizeof(header));
+    if(size != sizeof(header) || memcmp(header.magic, PEER_CACHE_MAGIC, 8) || header.version != PEER_CACHE_VERSION
+        || header.count > PEER_CACHE_CAPACITY) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    size = read(fd, cache->peers, header.count * sizeof(struct peer));
+    close(fd);
+    if(size != (ssize_t)(header.count * sizeof(struct peer))) {
+        errno = EINVAL;
+        return -1;
+    }
+    cache->count = header.count;
+    return 0;
+}
+
+/**
+ * Function: peer_expired
+ * ----------------------------
+ *  Whether a peer was last seen longer than the TTL ago, a TTL of 0 keeps the peers forever.
+ */
+
+static inline int peer_expired(const struct peer* peer, int64_t now, int64_t ttl) {
+    return ttl > 0 && now - peer->seen > ttl;
+}
+
+/**
+ * Function: peer_cache_save
+ * ----------------------------
+ *  Drop the expired peers and replace the cache file by a new one.
+ *      @param[in,out] cache Cache
+ *      @param[in] path Cache file
+ *      @param[in] now CLOCK_REALTIME seconds
+ *      @param[in] ttl Seconds a peer is kept after it was seen
+ *
+ *      @return 0 on success and -1 on error, errno is kept
+ */
+
+static inline int peer_cache_save(struct peer_cache* cache, const char* path, int64_t now, int64_t ttl) {
+
+    struct peer_cache_header header = { PEER_CACHE_MAGIC, PEER_CACHE_VERSION, 0 };
+    char temporary[PATH_MAX];
+
+    for(uint32_t i = 0; i < cache->count; i++) {
+        if(!peer_expired(&cache->peers[i], now, ttl))
+            cache->peers[header.count++] = cache->peers[i];
+    }
+    cache->count = header.count;
+
+    if(snprintf(temporary, sizeof(temporary), "%s.%d", path, getpid()) >= (int)sizeof(temporary)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return -1;
+
+    ssize_t size = sizeof(header) + cache->count * sizeof(struct peer);
+    struct iovec parts[2] = { { &header, sizeof(header) }, { cache->peers, cache->count * sizeof(struct peer) } };
+
+    ssize_t written = writev(fd, parts, 2);
+    int closed = close(fd);
+
+    if(written != size || closed || rename(temporary, path)) {
+        int error = errno;
+        unlink(temporary);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Function: peer_cache_update
+ * ----------------------------
+ *  Add a peer found by a scan or refresh it, what the scan did not ask for (the name, the
+ *  RSSI) is kept from the earlier scans.
+ *      @param[in,out] cache Cache
+ *      @param[in] found Peer of peer_parse_result, with seen set
+ *
+ *      @return The cached peer
+ */
+
+static inline struct peer* peer_cache_update(struct peer_cache* cache, const struct peer* found) {
+
+    struct peer* peer;
+
+    for(uint32_t i = 0; i < cache->count; i++) {
+        peer = &cache->peers[i];
+        if(peer->address != found->address)
+            continue;
+        struct peer merged = *found;
+        if(!merged.name[0])
+            memcpy(merged.name, peer->name, PEER_NAME_SIZE);
+        if(merged.rssi == PEER_RSSI_UNKNOWN)
+            merged.rssi = peer->rssi;
+        *peer = merged;
+        return peer;
+    }
+
+    if(cache->count < PEER_CACHE_CAPACITY)
+        peer = &cache->peers[cache->count++];
+    else {
+        peer = &cache->peers[0];
+        for(uint32_t i = 1; i < cache->count; i++) {
+            if(cache->peers[i].seen < peer->seen)
+                peer = &cache->peers[i];
+        }
+    }
+
+    *peer = *found;
+    return peer;
+}
+
+/**
+ * Function: peer_cache_lookup
+ * ----------------------------
+ *  Find the peers a connect target stands for. A name that matches exactly (ignoring case)
+ *  wins, otherwise every peer whose name or printed address starts with the target matches;
+ *  ':' and '-' in an address prefix are ignored.
+ *      @param[in] cache Cache
+ *      @param[in] target Name, name prefix or address prefix
+ *      @param[in] now CLOCK_REALTIME seconds
+ *      @param[in] ttl Seconds a peer is kept after it was seen, expired peers never match
+ *      @param[out] matches Matching peers
+ *      @param[in] max_matches Size of matches
+ *
+ *      @return Number of matching peers, may be larger than max_matches
+ */
+
+static inline int peer_cache_lookup(struct peer_cache* cache, const char* target, int64_t now, int64_t ttl, struct peer** matches, int max_matches) {
+
+    char prefix[13];
+    int prefix_size = 0, count = 0;
+    size_t target_size = strlen(target);
+
+    for(const char* c = target; *c && prefix_size >= 0; c++) {
+        if(isxdigit((unsigned char)*c) && prefix_size < 12)
+            prefix[prefix_size++] = toupper((unsigned char)*c);
+        else if(*c != ':' && *c != '-')
+            prefix_size = -1;
+    }
+
+    for(uint32_t i = 0; i < cache->count; i++) {
+        struct peer* peer = &cache->peers[i];
+        if(!peer_expired(peer, now, ttl) && peer->name[0] && !strcasecmp(peer->name, target)) {
+            if(count < max_matches)
+                matches[count] = peer;
+            count++;
+        }
+    }
+    if(count > 0)
+        return count;
+
+    for(uint32_t i = 0; i < cache->count; i++) {
+
+        struct peer* peer = &cache->peers[i];
+        char address[13];
+
+        if(peer_expired(peer, now, ttl))
+            continue;
+        peer_address_format(peer->address, address);
+
+        if((target_size > 0 && !strncasecmp(peer->name, target, target_size))
+            || (prefix_size > 0 && !strncmp(address, prefix, prefix_size))) {
+            if(count < max_matches)
+                matches[count] = peer;
+            count++;
+        }
+    }
+    return count;
+}
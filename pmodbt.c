@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
@@ -8,7 +9,29 @@
 #include <argp.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/serial.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stddef.h>
 #include "oledDisplay.h"
+#include "uartFrame.h"
+#include "uartLz.h"
+#include "uartTrace.h"
+#include "peerCache.h"
 
 /**
  * Defines for developing
@@ -16,16 +39,400 @@
 //#define DEBUG 
 #define RELEASE 
 
+/**
+ * Deadlines for the device responses, in milliseconds
+ */
+#define CMD_MODE_TIMEOUT_MS 1000    // $$$ and ---, the module waits for its guard time
+#define QUERY_TIMEOUT_MS 500        // GK, GR and the other get commands
+#define ACTION_TIMEOUT_MS 2000      // C, and K, answer once the radio has accepted the request
+#define RESPONSE_GRACE_MS 5         // Quiet time after a response without <cr><lf> before it is taken as complete
+
+/**
+ * Command session, keeps the device in CMD mode across several operations and sends the queued
+ * commands in a single write. The responses are matched to the requests in order.
+ */
+#define SESSION_MAX_COMMANDS 8
+
+struct cmd_request {
+    char command[64];       // Command including the <cr>
+    int command_size;
+    int timeout_ms;
+    char response[256];     // Response without the line terminator
+    int response_size;      // -1 until the response has been received
+};
+
+struct cmd_session {
+    int device_descriptor;
+    int in_cmd_mode;
+    void (*drain)(void* context, char* data, int size);    // Takes the data mode bytes nobody has read before "$$$", NULL discards them
+    void* drain_context;
+    int count;              // Number of queued requests
+    int flushed;            // The requests have been sent, the next queue starts a new pipeline
+    struct cmd_request requests[SESSION_MAX_COMMANDS];
+};
+
+/**
+ * Response being received, bytes are added one at a time until is_complete_response takes them
+ */
+struct response_reader {
+    char response[256];     // Null terminated, without the line terminators in front
+    int size;
+};
+
+/**
+ * Context of one serial module. --device can be given several times, the fleet operations
+ * (--status, --connect, --disconnect, --restart, --exitCMDmode) run the same pipeline on every
+ * device from one poll loop, so a rack takes about as long as a single module. They run at
+ * 115200, --baud is only negotiated for the data modes, which drive a single device.
+ */
+#define MAX_DEVICES 16
+
+enum { FLEET_ENTER, FLEET_PIPELINE, FLEET_DONE };
+
+struct pmod_device {
+    char* name;
+    int descriptor;
+    int baud;                       // Speed the module runs at, changed by --baud until the end of the run
+    struct cmd_session session;     // in_cmd_mode tells whether the module is in CMD mode
+    int fleet_state;                // FLEET_ enum, progress of the fleet operation
+    int fleet_next;                 // Request whose response is being received
+    int fleet_failed;
+    long long fleet_deadline_ms;
+    long long fleet_last_byte_ms;
+    long long fleet_started_us;
+    long long fleet_sent_us;        // Of the pending write or the last response, for the command latencies
+    long long fleet_done_us;        // 0 unless every response came
+    struct response_reader reader;
+};
+
+/**
+ * Daemon mode, one process owns the device and serves clients on a Unix socket.
+ * Requests and replies are text lines, received data is sent to subscribers as DATA <size>\n<bytes>
+ */
+#define DAEMON_SOCKET_PATH "/tmp/pmodbt.sock"
+#define DAEMON_MAX_CLIENTS 16
+
+struct daemon_client {
+    int fd;                 // -1 if the slot is free
+    int subscribed;
+    int line_size;
+    char line[256];
+};
+
+/**
+ * Inquiry, the peers found by a scan are cached on disk so --connect takes a name or an address
+ * prefix without scanning again (see peerCache.h)
+ */
+#define PEER_CACHE_PATH "/var/tmp/pmodbt.peers"
+#define PEER_CACHE_TTL 3600         // Seconds a peer is kept after the last scan that found it
+#define INQUIRY_DEFAULT_SECONDS 10  // Scan time of the module, IQ always scans this long
+#define INQUIRY_MAX_SECONDS 48
+#define INQUIRY_NAMES_MS 10000      // After the scan IN asks every peer for its name
+#define PEER_MAX_MATCHES 8          // Candidates listed for an ambiguous --connect
+
+/**
+ * OLED display, 128x32 pixels in 4 pages of 128 bytes, one page per line of 16 characters.
+ * Only the glyph cells that changed since the last update are written.
+ */
+#define OLED_DEVICE "/dev/zed_oled"
+#define OLED_FRAME_SIZE 512
+#define OLED_PAGE_SIZE 128
+#define OLED_PAGES 4
+
+struct oled_display {
+    int fd;
+    int shown_valid;                    // shown holds what the device displays
+    int partial_updates;                // The driver takes writes at an offset, cleared on the first failure
+    char frame[OLED_FRAME_SIZE];        // What the next update has to show
+    char shown[OLED_FRAME_SIZE];
+    unsigned long updates;
+    unsigned long full_frames;
+    unsigned long bytes_written;
+};
+
+/**
+ * OLED console, a terminal of 4 lines of 16 characters. The lines are kept rendered in a circular
+ * set of pages, new characters are drawn in place and scrolling only moves the first page.
+ */
+struct oled_console {
+    char rows[OLED_PAGES][OLED_PAGE_SIZE];  // Rendered lines, rows[top] is shown on the first page
+    int top;
+    int line;                               // Page of the cursor
+    int column;
+    int after_cr;                           // The <lf> of a <cr><lf> does not start another line
+    int scrolled;                           // Every page moved since the last compose
+    int dirty_rows;                         // Bit per row changed since the last compose
+};
+
+/**
+ * Receive ring, the UART reader is the only producer and every consumer has its own read cursor.
+ * The console consumer is lossless, the producer never overwrites what it has not printed yet.
+ * The display consumer only needs the latest bytes and skips ahead when it falls behind.
+ */
+#define RX_RING_SIZE 16384      // Power of two
+#define RX_DISPLAY_BYTES 256    // Backlog the display still renders, older bytes are skipped
+
+enum { RX_CONSOLE, RX_DISPLAY, RX_CONSUMERS };
+
+#define RX_THREADS (RX_CONSUMERS + 2)   // The reader, the consumers and the OLED writer
+#define OLED_DEFAULT_FPS 20
+
+struct rx_ring {
+    int device_descriptor;
+    char* oled_name;
+    int wakeup[RX_CONSUMERS];           // eventfd per consumer, signalled after new bytes are published
+    int received;                       // eventfd of the main thread, signalled after new bytes or a HELLO
+    int stop;                           // eventfd, the reader returns once it is signalled
+    atomic_int stopping;                // The consumers and the OLED writer return once they are idle
+    atomic_size_t head;                 // Written by the producer only
+    atomic_size_t tail[RX_CONSUMERS];   // Written by their consumer only
+    atomic_size_t high_water;           // Most bytes the console consumer has been behind
+    atomic_size_t dropped;              // Bytes read from the device while the ring was full
+    struct oled_display display;        // Owned by the OLED writer
+    struct oled_console console;        // Shared by the display consumer and the OLED writer
+    pthread_mutex_t console_lock;
+    pthread_cond_t console_changed;
+    int console_pending;                // The console changed since the last frame
+    int frame_period_us;
+    unsigned long console_writes;       // Renders of the display consumer, coalesced into the frames
+    int framed;                         // Only the payloads of the data frames go into the ring
+    struct frame_decoder decoder;       // Owned by the reader
+    struct frame_decoder inflated;      // Frames of the inflated FRAME_TYPE_DATA_LZ blocks, owned by the reader
+    atomic_int peer_capabilities;       // FRAME_CAP_ flags from the HELLO of the peer, -1 until then
+    unsigned long inflated_blocks;
+    unsigned long long inflated_in;
+    unsigned long long inflated_out;
+    char data[RX_RING_SIZE];
+};
+
+/**
+ * Latency histogram, log2 buckets split in 4 linear sub-buckets, values in microseconds. The
+ * counters are atomic so a histogram can be read while other threads add to it.
+ */
+#define HISTOGRAM_BUCKETS 128
+
+struct latency_histogram {
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+    atomic_ulong samples;
+    atomic_ullong max;
+};
+
+/**
+ * Scheduling of the thread reading the device: the reader thread of --uart, the main thread of
+ * --raw, --bench, the file transfers and --daemon. Without the privilege every setting falls back
+ * to the normal scheduler with a note on stderr, the run goes on.
+ */
+#define JITTER_PERIOD_US 1000   // Wakeup period of --jitter
+
+struct rt_settings {
+    int priority;           // SCHED_FIFO priority, 0 keeps SCHED_OTHER
+    int cpu;                // CPU the threads are pinned to, -1 for any
+    int display;            // The OLED writer gets priority - 1 and the same CPU
+    int lock_memory;        // mlockall before the threads start
+};
+
+/**
+ * Counters of the whole run, every thread adds to them with relaxed atomics. SIGUSR1 dumps them
+ * to stderr and --stats-file rewrites them into a file every second, I/O never waits for either.
+ */
+#define STATS_INTERVAL_MS 1000
+
+enum stats_command { STATS_ENTER, STATS_EXIT, STATS_CONNECT, STATS_KILL, STATS_GK, STATS_GR, STATS_BAUD, STATS_REBOOT, STATS_OTHER, STATS_COMMANDS };
+
+static const char* stats_command_names[STATS_COMMANDS] = { "$$$", "---", "C,", "K,", "GK", "GR", "U,", "R,1", "other" };
+
+struct command_stats {
+    atomic_ulong count;
+    atomic_ulong errors;                // Answered with ERR or ?
+    atomic_ulong timeouts;              // No complete response, not in the histogram
+    struct latency_histogram latency;   // From the write of the command, or the previous response of its pipeline, to its response
+};
+
+struct link_stats {
+    long long start_us;
+    char* path;                         // Stats file or NULL
+    atomic_ullong tx_bytes;
+    atomic_ulong tx_writes;
+    atomic_ullong rx_bytes;
+    atomic_ulong rx_reads;
+    atomic_ullong rx_response_bytes;    // CMD mode responses, read one byte at a time, not in rx_bytes and rx_reads
+    atomic_ulong frames_received;
+    atomic_ulong frames_damaged;        // Bad CRC or length, counted from the decoders of the device
+    struct command_stats commands[STATS_COMMANDS];
+};
+
+/**
+ * Outbound batching, small messages are merged into larger writes. A batch is written when it
+ * reaches the flush size, when its oldest message has waited the flush delay, on a <cr> or on
+ * an explicit barrier.
+ */
+#define TX_BATCH_CAPACITY 4096
+#define TX_BATCH_MAX_MESSAGES 64
+#define TX_DEFAULT_FLUSH_SIZE 512
+
+struct tx_batch {
+    int device_descriptor;
+    int baud;                           // Of the module, for the worth of the compression
+    int flush_size;
+    int flush_delay_us;                 // 0 writes every message right away
+    int flush_on_cr;                    // Off for frames, their <cr> bytes are no line ends
+    char buffer[TX_BATCH_CAPACITY];
+    int size;
+    int messages_pending;
+    long long enqueued_us[TX_BATCH_MAX_MESSAGES];
+    unsigned long messages;
+    unsigned long writes;
+    unsigned long long bytes;
+    struct latency_histogram added_latency;
+    int compress;                       // The batch holds whole frames and the peer inflates FRAME_TYPE_DATA_LZ
+    unsigned long compressed_blocks;
+    unsigned long raw_blocks;           // Did not shrink, sent as they were
+    unsigned long long compress_in;
+    unsigned long long compress_out;
+};
+
+/**
+ * Raw pipe mode of --uart, stdin goes to the device and the device to stdout without tokenizing
+ */
+#define RAW_CHUNK_SIZE 65536
+#define RAW_LINGER_MS 1000      // After the end of stdin, wait this long for the last bytes of the peer
+#define TOKEN_LINGER_STEP_MS 100 // The token loop stops once the peer was quiet this long
+#define HELLO_TIMEOUT_MS 500    // Wait this long for the capabilities of the peer before the first message
+#define TOKEN_SIZE 254          // Longest word of the token loop, longer ones are split as scanf("%254s") did
+
+/**
+ * Event sources of the token loop, a single poll() waits for all of them
+ */
+enum { EVENT_SHUTDOWN, EVENT_STDIN, EVENT_TIMER, EVENT_RECEIVED, EVENT_SOURCES };
+
+/**
+ * Benchmark of the link against a peer that echoes the data, every message is a frame with
+ * its sequence number in front of the pattern
+ */
+#define BENCH_HEADER_SIZE 4         // Sequence number in front of the pattern
+#define BENCH_MAX_IN_FLIGHT 4096    // Bytes on their way, the echo of a whole window has to fit the tty buffers
+#define BENCH_TIMEOUT_MS 2000       // A message not echoed within this is lost
+
+enum bench_pattern { BENCH_COUNTER, BENCH_RANDOM, BENCH_TEXT };
+
+struct bench_settings {
+    int payload_size;
+    int count;
+    int window;                     // Messages on their way at once
+    enum bench_pattern pattern;
+};
+
+/**
+ * File transfer, the chunks are sent ahead up to a window and acknowledged cumulatively by the
+ * receiver, which only writes them in order. Next to the partial file the receiver keeps a
+ * sidecar naming the transfer; a new run resumes only an offer of the same name and size whose
+ * written prefix still has the CRC recorded in the sidecar.
+ */
+#define FILE_OFFSET_SIZE 8
+#define FILE_CHUNK_SIZE (FRAME_MAX_PAYLOAD - FILE_OFFSET_SIZE)
+#define FILE_WINDOW_BYTES 8192      // Bytes sent ahead of the last acknowledged offset
+#define FILE_RETRY_MS 500           // Without progress, send again from the last acknowledged offset
+#define FILE_GIVE_UP_MS 10000       // Without any acknowledgement the link is considered lost
+#define FILE_LINGER_MS 1000         // The receiver keeps acknowledging this long after the last byte
+#define FILE_PROGRESS_MS 200
+#define FILE_DUPLICATE_ACKS 3       // Acknowledgements of the same offset that start a retransmit
+#define FILE_RESUME_SUFFIX ".part"  // Sidecar of the partial file, removed once the file is complete
+#define FILE_RESUME_MAGIC "BTPART01"
+
+struct file_resume {
+    char magic[8];
+    uint64_t size;                  // Size of the offer
+    uint64_t offset;                // Bytes written in order, the next chunk expected
+    uint32_t crc;                   // frame_crc32 of the bytes below the offset
+    uint32_t name_size;
+    char name[FILE_CHUNK_SIZE];     // Name of the offer, not terminated
+};
+
+/**
+ * UART speeds of the module, the token is the rate as the U command takes it
+ */
+#define MODULE_DEFAULT_BAUD 115200
+#define BAUD_SETTLE_MS 50       // The module switches right after the AOK, give both ends time to settle
+
+struct baud_rate {
+    int rate;
+    speed_t speed;
+    const char* token;
+};
+
+static const struct baud_rate baud_rates[] = {
+    { 1200, B1200, "1200" },
+    { 2400, B2400, "2400" },
+    { 4800, B4800, "4800" },
+    { 9600, B9600, "9600" },
+    { 19200, B19200, "19.2" },
+    { 38400, B38400, "38.4" },
+    { 57600, B57600, "57.6" },
+    { 115200, B115200, "115K" },
+    { 230400, B230400, "230K" },
+    { 460800, B460800, "460K" },
+    { 921600, B921600, "921K" },
+};
+
+/**
+ * Latency profiles of the tty. Every read follows a poll, so VMIN and VTIME only decide how long a
+ * read keeps collecting bytes once the first one is there: VMIN 1 returns what has arrived, VMIN 255
+ * with VTIME 1 waits for 255 bytes or a 100 ms gap after the last one. ASYNC_LOW_LATENCY makes the
+ * serial driver push every received byte to the tty right away instead of at its FIFO threshold.
+ */
+#define TTY_DEFAULT_PROFILE "balanced"
+
+struct tty_profile {
+    const char* name;
+    cc_t vmin;
+    cc_t vtime;             // Tenths of a second
+    int low_latency;        // Set ASYNC_LOW_LATENCY, 0 leaves the driver setting as it is
+    int read_chunk;         // Largest read from the device
+    int write_chunk;        // Default --flush-size, and the stdin reads of --raw
+};
+
+static const struct tty_profile tty_profiles[] = {
+    { "interactive", 1, 0, 1, 64, 64 },
+    { "balanced", 0, 1, 0, 4096, TX_DEFAULT_FLUSH_SIZE },
+    { "bulk", 255, 1, 0, RAW_CHUNK_SIZE, TX_BATCH_CAPACITY },
+};
+
 /** Variable for detecting CTRL-C */
 
 static volatile int keep_running = 1;
 
+/** eventfd signalled on SIGINT and SIGTERM, every wait that can block for long polls it too */
+
+int SHUTDOWN_EVENT = -1;
+
+/** Devices of the run, opened by main, the stats dump reads their speeds */
+
+struct pmod_device DEVICES[MAX_DEVICES];
+int DEVICE_COUNT = 0;
+
 /**
  * Declarations specific argp (program arguments and specs)
  */
-int COMMAND_MODE = 0;
+
+/** Profile the tty was set up with, see apply_tty_profile */
+
+const struct tty_profile* TTY_PROFILE = &tty_profiles[1];
+
+/** Scheduling of the device reader, see rt_apply */
+
+struct rt_settings RT = { 0, -1, 0, 0 };
+
+/** Counters of the run, see struct link_stats */
+
+struct link_stats LINK_STATS;
+
+/** Capture of the device traffic, open with --trace-file */
+
+struct uart_trace TRACE;
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state);
+const struct baud_rate* find_baud_rate(int rate);
+const struct tty_profile* find_tty_profile(const char* name);
 
 const char *argp_program_version = "PmodBT2 Uart Communication 0.1";
 const char *argp_program_bug_address = "claudiu.ghenea15@yahoo.ro";
@@ -35,11 +442,45 @@ static char args_doc[] = "";
 
 static struct argp_option options[] = { 
     { "uart", 'u', 0, 0, "Simple comunication with the connected bluetooth device or with the PMOD."},
-    { "connect", 'c', "[Bluetooth Address]", 0, "Connect to given bluetooth address. The address must be provided in the following format [11:22:33:44:55:66]\n"},
+    { "connect", 'c', "[Bluetooth Address]", 0, "Connect to given bluetooth address. The address must be provided in the following format [11:22:33:44:55:66], or a name or the start of a name or address of a peer cached by --inquiry\n"},
     { "attack", 'a', "[Bluetooth Address]", 0, "Try to make a DOS attack at given bluetooth address. he address must be provided in the following format [11:22:33:44:55:66]\n"},
     { "disconnect", 'd', 0, 0, "Disconnect the device."},
     { "restart", 'r', 0, 0, "Reboot device."},
     { "exitCMDmode", 'e', 0, 0, "Exit CMD mode."},
+    { "raw", 'w', 0, 0, "With --uart, pipe stdin to the device and the device to stdout unchanged, in large chunks."},
+    { "flush-size", 'z', "[Bytes]", 0, "Outbound batches are written once they hold this many bytes (default of the profile, 512 for balanced)."},
+    { "flush-delay", 'y', "[Microseconds]", 0, "Merge small outbound messages for up to this long, a <cr> flushes right away (default 0, no batching)."},
+    { "baud", 'b', "[Rate]", 0, "Switch the module and the tty to this baud rate for the run of --uart, --bench, the file transfers, --daemon or --attack, up to 921600 (default 115200)."},
+    { "flow", 'f', 0, 0, "Use RTS/CTS hardware flow control on the tty."},
+    { "profile", 'p', "[interactive|balanced|bulk]", 0, "Latency profile of the tty, sets VMIN/VTIME, the low latency flag of the serial driver and the read and write sizes together. bulk reads wait up to 100 ms for more bytes (default " TTY_DEFAULT_PROFILE ")."},
+    { "framed", 'x', 0, 0, "With --uart, send every message as a CRC checked frame and show only the payloads of the received frames."},
+    { "bench", 'B', 0, 0, "Measure goodput, round trip times, loss and corruption of the link, the connected peer has to echo the data."},
+    { "bench-size", 'S', "[Bytes]", 0, "Payload of the benchmark messages, 4 - 1024 (default 64)."},
+    { "bench-count", 'N', "[Messages]", 0, "Messages sent by the benchmark (default 1000)."},
+    { "bench-window", 'W', "[Messages]", 0, "Messages on their way at once (default 8)."},
+    { "bench-pattern", 'P', "[counter|random|text]", 0, "Payload pattern of the benchmark (default counter)."},
+    { "send-file", 'T', "[File path]", 0, "Send a file to the connected peer running --recv-file, resumes where an earlier transfer stopped."},
+    { "recv-file", 'R', "[File path]", 0, "Receive a file from the connected peer running --send-file, a partial file of the same transfer is continued."},
+    { "compress", 'C', 0, 0, "With --uart, compress what is sent when the peer can inflate it, implies --framed."},
+    { "stats-file", 'L', "[File path]", 0, "Rewrite the command latencies and the byte counters into this file every second, SIGUSR1 prints them at any time."},
+    { "trace-file", 'K', "[File path]", 0, "Capture every byte to and from the device into this ring file, see tracedump."},
+    { "rt-prio", 'Q', "[Priority]", 0, "Run the thread reading the device under SCHED_FIFO at this priority, 1 - 99."},
+    { "cpu", 'U', "[CPU]", 0, "Pin the thread reading the device to this CPU."},
+    { "rt-display", 'Y', 0, 0, "Give the OLED writer the CPU of --cpu and the priority of --rt-prio minus one too."},
+    { "mlock", 'M', 0, 0, "Lock the memory of the process so the reader never waits for swap."},
+    { "jitter", 'J', "[Seconds]", 0, "Measure how late the reader would wake up with --rt-prio and --cpu, without the device."},
+    { "device", 'D', "[Device path]", 0, "Serial device the PmodBT2 is attached to (default /dev/ttyPS1). Give it several times to run --status, --connect, --disconnect, --restart or --exitCMDmode on every module at once."},
+    { "status", 'g', 0, 0, "Print whether each device is connected and to which address."},
+    { "inquiry", 'I', "Seconds", OPTION_ARG_OPTIONAL, "Scan for the peers in range with their names and add them to the peer cache, 1 - 48 seconds (default 10)."},
+    { "rssi", 'q', 0, 0, "Scan for the RSSI of the peers in range instead of their names and add them to the peer cache, the module scans its default 10 seconds."},
+    { "peers", 'l', 0, 0, "Print the cached peers without touching the device."},
+    { "peer-cache", 'H', "[File path]", 0, "Peer cache of --inquiry and --connect (default " PEER_CACHE_PATH ")."},
+    { "peer-ttl", 'A', "[Seconds]", 0, "Forget the peers not seen by a scan for this long, 0 keeps them (default 3600)."},
+    { "oled", 'O', "[Device path]", 0, "OLED display the received data is shown on (default " OLED_DEVICE ")."},
+    { "fps", 'F', "[Frames]", 0, "Maximum OLED updates per second, the changes in between are coalesced (default 20)."},
+    { "daemon", 'm', 0, 0, "Keep the device open and serve connect, disconnect, status, send and subscribe requests on a Unix socket."},
+    { "socket", 's', "[Socket path]", 0, "Unix socket of the daemon (default " DAEMON_SOCKET_PATH ")."},
+    { "ctl", 'k', "[Request]", 0, "Send a request to the running daemon and print the reply, e.g. --ctl status"},
     { 0 } 
 };
 
@@ -51,30 +492,47 @@ struct arguments {
         EXITCMDMODE,
         REBOOT,
         ATTACK,
+        DAEMON,
+        BENCH,
+        SEND_FILE,
+        RECV_FILE,
+        CONTROL,
+        JITTER,
+        STATUS,
+        INQUIRY,
+        PEERS,
         UNSET
     } mode;
     char* ble_address;
+    char* device_names[MAX_DEVICES];
+    int device_count;
+    int raw;
+    int flush_size;
+    int flush_delay_us;
+    int baud;
+    int flow;
+    const struct tty_profile* profile;
+    int framed;
+    int compress;
+    struct bench_settings bench;
+    char* file_path;
+    char* stats_path;
+    char* trace_path;
+    char* socket_path;
+    char* oled_name;
+    int oled_fps;
+    char* request;
+    struct rt_settings rt;
+    int jitter_seconds;
+    int inquiry_seconds;
+    int inquiry_rssi;
+    char* peer_cache_path;
+    int peer_ttl;
     char formatted_mac[13];
 };
 
 static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
 
-
-/**
- * Function interrupt_handler
- * ----------------------------
- *  Handler for SIGINT 
- * 
- *      @param[in] dummy interrupt source
- */
-
-void interrupt_handler(int dummy) {
-    keep_running = 0;
-    printf("Keyboard Interrupt!\n");
-    //raise (SIGALRM);
-    ualarm(100, 0);
-}
-
 /**
  * Function is_valid_mac_address
  * ----------------------------
@@ -128,6 +586,79 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     case 'r': arguments->mode = REBOOT; break;
     case 'a': arguments->ble_address = arg; arguments->mode = ATTACK; break;
     case 'c': arguments->ble_address = arg; arguments->mode = CONNECT; break;
+    case 'D':
+        if(arguments->device_count == MAX_DEVICES)
+            argp_error(state, "at most %d devices", MAX_DEVICES);
+        arguments->device_names[arguments->device_count++] = arg;
+        break;
+    case 'g': arguments->mode = STATUS; break;
+    case 'I':
+        if(arg)
+            arguments->inquiry_seconds = atoi(arg);
+        if(arguments->inquiry_seconds < 1 || arguments->inquiry_seconds > INQUIRY_MAX_SECONDS)
+            argp_error(state, "the inquiry takes 1 - %d seconds", INQUIRY_MAX_SECONDS);
+        arguments->mode = INQUIRY;
+        break;
+    case 'q': arguments->inquiry_rssi = 1; arguments->mode = INQUIRY; break;
+    case 'l': arguments->mode = PEERS; break;
+    case 'H': arguments->peer_cache_path = arg; break;
+    case 'A':
+        arguments->peer_ttl = atoi(arg);
+        if(arguments->peer_ttl < 0)
+            argp_error(state, "invalid TTL %s", arg);
+        break;
+    case 'w': arguments->raw = 1; break;
+    case 'b':
+        arguments->baud = atoi(arg);
+        if(!find_baud_rate(arguments->baud))
+            argp_error(state, "unsupported baud rate %s", arg);
+        break;
+    case 'f': arguments->flow = 1; break;
+    case 'p':
+        arguments->profile = find_tty_profile(arg);
+        if(!arguments->profile)
+            argp_error(state, "unknown profile %s", arg);
+        break;
+    case 'x': arguments->framed = 1; break;
+    case 'C': arguments->compress = 1; arguments->framed = 1; break;
+    case 'L': arguments->stats_path = arg; break;
+    case 'K': arguments->trace_path = arg; break;
+    case 'B': arguments->mode = BENCH; break;
+    case 'T': arguments->mode = SEND_FILE; arguments->file_path = arg; break;
+    case 'R': arguments->mode = RECV_FILE; arguments->file_path = arg; break;
+    case 'S':
+        arguments->bench.payload_size = atoi(arg);
+        if(arguments->bench.payload_size < BENCH_HEADER_SIZE || arguments->bench.payload_size > FRAME_MAX_PAYLOAD)
+            argp_error(state, "the payload has to be %d - %d bytes", BENCH_HEADER_SIZE, FRAME_MAX_PAYLOAD);
+        break;
+    case 'N': arguments->bench.count = atoi(arg); break;
+    case 'W': arguments->bench.window = atoi(arg); break;
+    case 'P':
+        if(!strcmp(arg, "counter")) arguments->bench.pattern = BENCH_COUNTER;
+        else if(!strcmp(arg, "random")) arguments->bench.pattern = BENCH_RANDOM;
+        else if(!strcmp(arg, "text")) arguments->bench.pattern = BENCH_TEXT;
+        else argp_error(state, "unknown pattern %s", arg);
+        break;
+    case 'z': arguments->flush_size = atoi(arg); break;
+    case 'y': arguments->flush_delay_us = atoi(arg); break;
+    case 'O': arguments->oled_name = arg; break;
+    case 'F': arguments->oled_fps = atoi(arg); break;
+    case 'm': arguments->mode = DAEMON; break;
+    case 's': arguments->socket_path = arg; break;
+    case 'k': arguments->request = arg; arguments->mode = CONTROL; break;
+    case 'Q':
+        arguments->rt.priority = atoi(arg);
+        if(arguments->rt.priority < sched_get_priority_min(SCHED_FIFO) || arguments->rt.priority > sched_get_priority_max(SCHED_FIFO))
+            argp_error(state, "SCHED_FIFO priority %s out of range", arg);
+        break;
+    case 'U':
+        arguments->rt.cpu = atoi(arg);
+        if(arguments->rt.cpu < 0 || arguments->rt.cpu >= CPU_SETSIZE)
+            argp_error(state, "invalid CPU %s", arg);
+        break;
+    case 'Y': arguments->rt.display = 1; break;
+    case 'M': arguments->rt.lock_memory = 1; break;
+    case 'J': arguments->jitter_seconds = atoi(arg); arguments->mode = JITTER; break;
     case ARGP_KEY_ARG: return 0;
     default: return ARGP_ERR_UNKNOWN;
     }   
@@ -143,11 +674,12 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
  *      @param[in] speed Baud rate for the selected serial device : 115200 used in this case \
  *          pecified by the PmodBT2 documentation
  *      @param[in] parity Parity bits, no parity in our case
+ *      @param[in] flow Use RTS/CTS hardware flow control
  * 
  *      @return Returns 0 if success or -1 otherwise
  */
 
-int initialize_serial(int fd, int speed, int parity) {
+int initialize_serial(int fd, int speed, int parity, int flow) {
 
     struct termios tty;
 
@@ -164,15 +696,19 @@ int initialize_serial(int fd, int speed, int parity) {
     tty.c_lflag = 0;        // No signaling chars & no echo
                             // No canonical processing
     tty.c_oflag = 0;        // No remapping, no delays
-    tty.c_cc[VMIN] = 0;     // Read doesn't block
-    tty.c_cc[VTIME] = 10;   // 1 second read timeout
+    tty.c_cc[VMIN] = 0;     // Read doesn't block, apply_tty_profile sets the profile afterwards
+    tty.c_cc[VTIME] = 0;
 
     tty.c_iflag &= ~(IXON | IXOFF | IXANY); // Turn off s/w flow ctrl
+    tty.c_iflag &= ~(ICRNL | INLCR | IGNCR | ISTRIP); // Keep the <cr><lf> of the responses as they are sent
     tty.c_cflag |= (CLOCAL | CREAD);   // Turn on READ & ignore ctrl lines (CLOCAL = 1)
     tty.c_cflag &= ~(PARENB | PARODD); // No parity
     tty.c_cflag |= parity;
     tty.c_cflag &= ~CSTOPB; // Only one stop bit
-    tty.c_cflag &= ~CRTSCTS; // Disable RTS/CTS hardware
+    if(flow)
+        tty.c_cflag |= CRTSCTS; // The module holds CTS while its buffer is full instead of dropping bytes
+    else
+        tty.c_cflag &= ~CRTSCTS; // Disable RTS/CTS hardware
     tty.c_oflag &= ~OPOST; // Prevent special interpretation of output bytes (e.g. newline chars)
     tty.c_oflag &= ~ONLCR; // Prevent conversion of newline to \r\n
 
@@ -183,375 +719,4081 @@ int initialize_serial(int fd, int speed, int parity) {
     return 0;
 }
 
-/*
- * Function: set_blocking
+/**
+ * Function: find_baud_rate
  * ----------------------------
- *   Sets blocking communication, 0 for non-blocking and 1 for blocking
- *
+ *  Returns the entry of the baud rate or NULL if the module does not support it.
+ *      @param[in] rate Baud rate, e.g. 921600
+ */
+
+const struct baud_rate* find_baud_rate(int rate) {
+
+    for(int i = 0; i < (int)(sizeof(baud_rates) / sizeof(baud_rates[0])); i++)
+        if(baud_rates[i].rate == rate)
+            return &baud_rates[i];
+    return NULL;
+}
+
+/**
+ * Function: set_serial_speed
+ * ----------------------------
+ *  Change only the speed of the tty, the rest of the settings stay as initialize_serial left them.
+ *      @param[in] fd File descriptor of serial device
+ *      @param[in] speed termios speed, e.g. B921600
+ * 
+ *      @return Returns 0 if success or -1 otherwise
  */
 
-void set_blocking(int fd) {
+int set_serial_speed(int fd, speed_t speed) {
 
     struct termios tty;
-    memset(&tty, 0, sizeof tty);
-    if (tcgetattr(fd, &tty) != 0) {
-        printf("Error %d from \"set_blocking::tggetattr\"\n", errno);
-        return;
-    }
 
-    /**
-     * @see https://man7.org/linux/man-pages/man3/termios.3.html
-     */
+    if(tcgetattr(fd, &tty) != 0) {
+        printf("Error %d from \"set_serial_speed::tcgetattr\"\n", errno);
+        return -1;
+    }
 
-    tty.c_cc[VMIN] = 0;
-    tty.c_cc[VTIME] = 10; // 1 second read timeout
+    cfsetospeed(&tty, speed);
+    cfsetispeed(&tty, speed);
 
-    if (tcsetattr(fd, TCSANOW, &tty) != 0)
-        printf("Error %d while setting device attributes! (\"set_blocking::tcsetattr\")\n", errno);
+    if(tcsetattr(fd, TCSADRAIN, &tty) != 0) {
+        printf("Error %d from \"set_serial_speed::tcsetattr\"\n", errno);
+        return -1;
+    }
+    return 0;
 }
 
 /**
- * Function: send_message_to_device
+ * Function: find_tty_profile
  * ----------------------------
- *  Send message to device
- *      @param[in] device_descriptor File descriptor of serial device
- *      @param[in] buffer Buffed containing the message to send
- *      @param[in] buffer_size Size of the buffer to send
- * 
- *      @return Returns number of bytes sent to device
+ *  Returns the latency profile of the name or NULL if there is none.
+ *      @param[in] name Profile name, e.g. bulk
  */
 
-int send_message_to_device(int device_descriptor, char* buffer, ssize_t buffer_size) {
-
-    int sent_bytes = write(device_descriptor, buffer, buffer_size);
-
-    #ifdef DEBUG
-        printf("DEBUG: Sent %d bytes to device: %s\n", sent_bytes, buffer);
-    #endif
+const struct tty_profile* find_tty_profile(const char* name) {
 
-    return sent_bytes;
+    for(int i = 0; i < (int)(sizeof(tty_profiles) / sizeof(tty_profiles[0])); i++)
+        if(!strcmp(tty_profiles[i].name, name))
+            return &tty_profiles[i];
+    return NULL;
 }
 
 /**
- * Function: get_response_from_device
+ * Function: apply_tty_profile
  * ----------------------------
- *  Send message to device and returns the message response generated by the device
- *      @param[in] device_descriptor File descriptor of serial device
- *      @param[in] buffer Buffed containing the message to send
- *      @param[in] buffer_size Size of the buffer to send
- *      @param[in] recv_buffer Empty buffer of size 256 for the message generated by the device
- * 
- *      @return Returns number of bytes read from the device
+ *  Set VMIN, VTIME and the low latency flag of a profile and report them. Pseudo-terminals and
+ *  USB adapters have no serial_struct, the profile is used without the flag then.
+ *      @param[in] fd File descriptor of serial device
+ *      @param[in] name Device path for the report
+ *      @param[in] profile Latency profile
+ *      @param[in] output Where the profile is reported
+ *
+ *      @return Returns 0 if success or -1 otherwise
+ *
+ *      @see https://man7.org/linux/man-pages/man3/termios.3.html
  */
 
-int get_response_from_device(int device_descriptor, char* buffer, size_t buffer_size, char* recv_buffer) {
+int apply_tty_profile(int fd, const char* name, const struct tty_profile* profile, FILE* output) {
 
-    int sent_bytes = send_message_to_device(device_descriptor, buffer, buffer_size);
+    struct termios tty;
+    const char* low_latency = "left to the driver";
 
-    if(sent_bytes == buffer_size) {
-        
-        usleep((buffer_size + 25) * 100); // sleep enough to transmit the 7 plus receive 25:  approx 100 uS per char transmit
+    if(tcgetattr(fd, &tty) != 0) {
+        printf("Error %d from \"apply_tty_profile::tcgetattr\"\n", errno);
+        return -1;
+    }
 
-        if(recv_buffer != NULL) { //Check the buffer to be allocated
-            int n = read(device_descriptor, recv_buffer, 256);  // Read up to 256 characters if ready to read 
-            if(n > 0) {
-                recv_buffer[n] = 0;
-                #ifdef DEBUG
-                    printf("DEBUG: Device has responded with %d bytes: %s\n", n, recv_buffer);
-                #endif
-            }
-            else 
-                printf("Error %d while reading from device! (\"get_response_from_device::read\")\n", errno);
-            return n;   
-        } 
+    tty.c_cc[VMIN] = profile->vmin;
+    tty.c_cc[VTIME] = profile->vtime;
+
+    if(tcsetattr(fd, TCSANOW, &tty) != 0) {
+        printf("Error %d while setting device attributes! (\"apply_tty_profile::tcsetattr\")\n", errno);
+        return -1;
     }
-    printf("Error %d while writing to the device! (\"get_response_from_device::write\")\n", errno);
-    return sent_bytes;
+
+    if(profile->low_latency) {
+        struct serial_struct serial;
+        if(ioctl(fd, TIOCGSERIAL, &serial) < 0)
+            low_latency = "not supported by the driver";
+        else {
+            serial.flags |= ASYNC_LOW_LATENCY;
+            low_latency = ioctl(fd, TIOCSSERIAL, &serial) < 0 ? "refused by the driver" : "on";
+        }
+    }
+
+    TTY_PROFILE = profile;
+
+    fprintf(output, "Profile %s on %s: VMIN %d, VTIME %d ms, low latency %s, reads of %d bytes, writes of %d bytes\n",
+        profile->name, name, profile->vmin, profile->vtime * 100, low_latency, profile->read_chunk, profile->write_chunk);
+    return 0;
 }
 
 /**
- * Function: enter_device_cmd_mode
+ * Function: monotonic_us
  * ----------------------------
- *  Set the device to CMD mode, prepare for sending commands.
- *      @param[in] device_descriptor File descriptor of serial device
- * 
- *      @return 0 if the device entered the CMD mode succesfullt and 1 otherwise
+ *  Returns the CLOCK_MONOTONIC time in microseconds
  */
 
-int enter_device_cmd_mode(int device_descriptor) {
+long long monotonic_us(void) {
 
-    char cmd_buffer[] = "$$$";
-    char* recv_buffer = malloc(sizeof(char) * 256);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-    get_response_from_device(device_descriptor, cmd_buffer, sizeof(cmd_buffer) - 1, recv_buffer);
-    if(!strncmp(recv_buffer, "CMD", 3)) {
-        free(recv_buffer);
-        COMMAND_MODE = 1;
-        return 0;
+/**
+ * Function: histogram_add
+ * ----------------------------
+ *  Count a value in its bucket, values below 4 have their own bucket, above that every power
+ *  of two is split in 4 buckets.
+ *      @param[in] histogram Latency histogram
+ *      @param[in] value Value in microseconds
+ */
+
+void histogram_add(struct latency_histogram* histogram, unsigned long long value) {
+
+    int bucket = value;
+
+    if(value >= 4) {
+        int msb = 63 - __builtin_clzll(value);
+        bucket = (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
     }
-    free(recv_buffer);
+    if(bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
 
-    printf("Device coudl be stuck in the CMD mode, try -e option first!\n");
+    atomic_fetch_add_explicit(&histogram->counts[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->samples, 1, memory_order_relaxed);
 
-    return 1;
+    unsigned long long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while(value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value, memory_order_relaxed, memory_order_relaxed))
+        ;
 }
 
 /**
- * Function: exit_device_cmd_mode
+ * Function: histogram_bucket_upper
  * ----------------------------
- *  Exit device CMD mode. ( ---<cr> )
- *      @param[in] device_descriptor File descriptor of serial device
- * 
- *      @return 0 if the device entered the CMD mode succesfullt and 1 otherwise
+ *  Returns the largest value counted in a bucket of the latency histogram.
+ *      @param[in] bucket Bucket, 0 - HISTOGRAM_BUCKETS - 1
  */
 
-int exit_device_cmd_mode(int device_descriptor) {
-
-    char cmd_buffer[] = {'-', '-','-', 0x0D};
-    char* recv_buffer = malloc(sizeof(char) * 256);
+unsigned long long histogram_bucket_upper(int bucket) {
 
-    get_response_from_device(device_descriptor, cmd_buffer, 4, recv_buffer);
-    if(!strncmp(recv_buffer, "END", 3)) {
-        free(recv_buffer);
-        COMMAND_MODE = 0;
-        return 0;
-    }
-    free(recv_buffer);
-    return 1;
+    if(bucket < 4)
+        return bucket;
+    int msb = bucket / 4 + 1;
+    return ((unsigned long long)(4 + bucket % 4 + 1) << (msb - 2)) - 1;
 }
 
 /**
- * Function: restart_device
+ * Function: histogram_percentile
  * ----------------------------
- *  Restart the device.
- * 
- *      @param[in] device_descriptor File descriptor of serial device
- * 
- *      @example R,1<cr> -> should echo 1,0,0 if connected
+ *  Returns the upper bound of the bucket holding the given percentile, at most 25% above the value.
+ *      @param[in] histogram Latency histogram
+ *      @param[in] percentile Percentile, 0 - 100
  */
 
-int restart_device(int device_descriptor) {
-    char cmd_buffer[] = {'R', ',', '1', 0x0D};
-    int sent_bytes = send_message_to_device(device_descriptor, cmd_buffer, 4);
-    return 1;
+unsigned long long histogram_percentile(struct latency_histogram* histogram, double percentile) {
+
+    unsigned long samples = atomic_load_explicit(&histogram->samples, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    unsigned long rank = samples * percentile / 100;
+    unsigned long seen = 0;
+
+    for(int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += atomic_load_explicit(&histogram->counts[bucket], memory_order_relaxed);
+        if(seen > rank || (seen >= samples && seen > 0)) {
+            unsigned long long upper = histogram_bucket_upper(bucket);
+            return upper < max ? upper : max;
+        }
+    }
+    return 0;
 }
 
 /**
- * Function: do_cleanup
+ * Function: stats_command
  * ----------------------------
- *  Resets the deivce to normal mode and | or resets it to apply the changes
- *      @param[in] device_descriptor File descriptor of serial device
- * 
+ *  Count a CMD mode command with its response.
+ *      @param[in] command Command as sent, with or without the <cr>
+ *      @param[in] response Response of the device
+ *      @param[in] response_size Size of the response, negative when none came
+ *      @param[in] latency_us From the write of the command to the response
  */
 
-int do_cleanup(int device_descriptor) {
+void stats_command(const char* command, const char* response, int response_size, long long latency_us) {
 
-    if(COMMAND_MODE) {
-        if(!exit_device_cmd_mode(device_descriptor))
-            return 0;
+    int index = STATS_OTHER;
+
+    for(int i = 0; i < STATS_OTHER; i++)
+        if(!strncmp(command, stats_command_names[i], strlen(stats_command_names[i])))
+            index = i;
+
+    struct command_stats* stats = &LINK_STATS.commands[index];
+
+    atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+    if(response_size < 0) {
+        atomic_fetch_add_explicit(&stats->timeouts, 1, memory_order_relaxed);
+        return;
     }
-    return 1;
+    if(!strncmp(response, "ERR", 3) || response[0] == '?')
+        atomic_fetch_add_explicit(&stats->errors, 1, memory_order_relaxed);
+    histogram_add(&stats->latency, latency_us);
 }
 
-
 /**
- * Function: connect_to_ble_address
+ * Function: link_frame_decode
  * ----------------------------
- *  Tell the module to connect to a given Bluetooth device by mac address.
- *      @param[in] device_descriptor File descriptor of serial device
- *      @param[in] address Target device mac address
- * 
- *      @return 0 If AOK
- *      @return 1 If ERR
- * 
- *      @example C,00A053112233<cr>
+ *  frame_decode for the frames read from the device, the received and damaged frames are counted.
  */
 
-int connect_to_ble_address(int device_descriptor, char* address) {
+int link_frame_decode(struct frame_decoder* decoder, const unsigned char** input, int* input_size, struct frame* frame) {
 
-    char* command_buffer = calloc(256, sizeof(char));
-    sprintf(command_buffer, "C,%s", address);
+    unsigned long damaged = decoder->crc_errors + decoder->length_errors;
+    int decoded = frame_decode(decoder, input, input_size, frame);
 
-    #ifdef DEBUG
-        printf("DEBUG: Sending connect command %s of length %lu\n", command_buffer, strlen(command_buffer));
-    #endif
+    if(decoder->crc_errors + decoder->length_errors != damaged)
+        atomic_fetch_add_explicit(&LINK_STATS.frames_damaged, decoder->crc_errors + decoder->length_errors - damaged, memory_order_relaxed);
+    if(decoded)
+        atomic_fetch_add_explicit(&LINK_STATS.frames_received, 1, memory_order_relaxed);
+    return decoded;
+}
 
-    command_buffer[strlen(command_buffer)-1] = 0x0D;
-    
-    //send_message_to_device(device_descriptor, command_buffer, strlen(command_buffer));
+/**
+ * Function: stats_count_tx
+ * ----------------------------
+ *  Count a write to the device.
+ *      @param[in] bytes Result of the write, nothing is counted for errors
+ */
 
-    get_response_from_device(device_descriptor, command_buffer, strlen(command_buffer), command_buffer);
+static inline void stats_count_tx(ssize_t bytes) {
 
-    /* Interpret the response AOK success ERR error ? fatal error */
+    if(bytes <= 0)
+        return;
+    atomic_fetch_add_explicit(&LINK_STATS.tx_bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&LINK_STATS.tx_writes, 1, memory_order_relaxed);
+}
 
-    if(!strncmp(command_buffer, "AOK", 3)) {
-        free(command_buffer);
-        return 0;
-    }
+/**
+ * Function: stats_count_response
+ * ----------------------------
+ *  Count bytes of CMD mode responses, kept apart from the data reads since the responses are
+ *  read a byte at a time.
+ *      @param[in] bytes Result of the read, nothing is counted for errors
+ */
+
+static inline void stats_count_response(ssize_t bytes) {
+
+    if(bytes > 0)
+        atomic_fetch_add_explicit(&LINK_STATS.rx_response_bytes, bytes, memory_order_relaxed);
+}
+
+/**
+ * Function: stats_count_rx
+ * ----------------------------
+ *  Count a read from the device.
+ *      @param[in] bytes Result of the read, nothing is counted for errors
+ */
+
+static inline void stats_count_rx(ssize_t bytes) {
+
+    if(bytes <= 0)
+        return;
+    atomic_fetch_add_explicit(&LINK_STATS.rx_bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&LINK_STATS.rx_reads, 1, memory_order_relaxed);
+}
+
+/**
+ * Function: trace_note
+ * ----------------------------
+ *  Capture a line of text between the device traffic, e.g. a speed change.
+ *      @param[in] format printf format of the text
+ */
+
+void trace_note(const char* format, ...) {
+
+    char note[128];
+    va_list args;
+
+    if(TRACE.header == NULL)
+        return;
+
+    va_start(args, format);
+    int size = vsnprintf(note, sizeof(note), format, args);
+    va_end(args);
+
+    trace_write(&TRACE, TRACE_NOTE, note, size < (int)sizeof(note) ? size : (int)sizeof(note) - 1);
+}
+
+/**
+ * Function: send_message_to_device
+ * ----------------------------
+ *  Send message to device
+ *      @param[in] device_descriptor File descriptor of serial device
+ *      @param[in] buffer Buffed containing the message to send
+ *      @param[in] buffer_size Size of the buffer to send
+ * 
+ *      @return Returns number of bytes sent to device
+ */
+
+int send_message_to_device(int device_descriptor, char* buffer, ssize_t buffer_size) {
+
+    uint64_t started = TRACE.header ? trace_clock_ns(CLOCK_MONOTONIC) : 0;
+    int sent_bytes = write(device_descriptor, buffer, buffer_size);
 
     #ifdef DEBUG
-        if(!strncmp(command_buffer, "?", 1)) {
-            printf("DEBUG: Fatal error in connect_to_ble_address::get_response_from_device()\n");
-        }
+        printf("DEBUG: Sent %d bytes to device: %s\n", sent_bytes, buffer);
     #endif
 
-    
-    free(command_buffer);
-    return 1;
+    stats_count_tx(sent_bytes);
+    trace_write_at(&TRACE, TRACE_TX, buffer, sent_bytes, started);
+    return sent_bytes;
+}
+
+/**
+ * Function: monotonic_ms
+ * ----------------------------
+ *  Returns the CLOCK_MONOTONIC time in milliseconds, used for the response deadlines
+ */
+
+long long monotonic_ms(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Function: is_complete_response
+ * ----------------------------
+ *  Checks if the received bytes hold a complete RN-42 response. The module ends its responses
+ *  with <cr><lf>, a lone <cr> or one of the fixed tokens without terminator are only complete
+ *  once the line has gone quiet (see RESPONSE_GRACE_MS).
+ *      @param[in] recv_buffer Bytes received so far, null terminated
+ *      @param[in] recv_size Number of bytes received so far
+ *      @param[in] line_idle The line has been quiet for the grace time
+ * 
+ *      @return Length of the response without the line terminator or -1 if it is not complete yet
+ */
+
+int is_complete_response(char* recv_buffer, int recv_size, int line_idle) {
+
+    static const char* known_tokens[] = { "CMD", "END", "AOK", "ERR", "?", "KILL", NULL };
+
+    if(recv_buffer[recv_size - 1] == 0x0A)
+        return recv_size > 1 && recv_buffer[recv_size - 2] == 0x0D ? recv_size - 2 : recv_size - 1;
+
+    if(!line_idle)
+        return -1;
+
+    if(recv_buffer[recv_size - 1] == 0x0D)
+        return recv_size - 1;
+
+    for(int i = 0; known_tokens[i]; i++) {
+        if(!strcmp(recv_buffer, known_tokens[i]))
+            return recv_size;
+    }
+    return -1;
+}
+
+/**
+ * Function: response_feed
+ * ----------------------------
+ *  Add a received byte to the response. Line terminators left over from a previous response
+ *  are skipped.
+ *      @param[in,out] reader Response being received
+ *      @param[in] byte Received byte
+ *      @param[in] line_idle The line has been quiet for the grace time, byte is ignored then
+ *
+ *      @return Length of the complete response, null terminated in the reader, or -1 if it is
+ *          not complete yet
+ */
+
+int response_feed(struct response_reader* reader, char byte, int line_idle) {
+
+    if(line_idle)
+        return reader->size > 0 ? is_complete_response(reader->response, reader->size, 1) : -1;
+
+    if(reader->size == 0 && (byte == 0x0D || byte == 0x0A))
+        return -1;
+    if(reader->size == (int)sizeof(reader->response) - 1)
+        return -1;
+
+    reader->response[reader->size++] = byte;
+    reader->response[reader->size] = 0;
+    return is_complete_response(reader->response, reader->size, 0);
+}
+
+/**
+ * Function: read_response_from_device
+ * ----------------------------
+ *  Accumulate bytes from the device until a complete response has been received or the deadline expires.
+ *  Line terminators left over from a previous response are skipped.
+ *      @param[in] device_descriptor File descriptor of serial device
+ *      @param[out] recv_buffer Buffer of size 256 for the response, null terminated without the CR/LF
+ *      @param[in] timeout_ms Deadline for the whole response in milliseconds
+ * 
+ *      @return Returns the length of the response or -1 if the deadline expired or the read failed
+ */
+
+int read_response_from_device(int device_descriptor, char* recv_buffer, int timeout_ms) {
+
+    struct pollfd device_poll = { .fd = device_descriptor, .events = POLLIN };
+    struct response_reader reader = { { 0 }, 0 };
+    long long deadline = monotonic_ms() + timeout_ms;
+    int response_size = -1;
+    char byte;
+
+    while(reader.size < 255) {
+
+        int remaining = (int)(deadline - monotonic_ms());
+        if(remaining <= 0)
+            break;
+
+        /** A response that could be complete only waits the grace time for more bytes */
+
+        int maybe_complete = response_feed(&reader, 0, 1) >= 0;
+        int wait_ms = maybe_complete && remaining > RESPONSE_GRACE_MS ? RESPONSE_GRACE_MS : remaining;
+
+        int ready = poll(&device_poll, 1, wait_ms);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready < 0)
+            break;
+
+        if(ready == 0) {
+            if(maybe_complete)
+                break;
+            continue;
+        }
+
+        /** Byte by byte, so nothing of the response that follows is consumed */
+
+        if(read(device_descriptor, &byte, 1) != 1)
+            break;
+        stats_count_response(1);
+        trace_write(&TRACE, TRACE_RX, &byte, 1);
+
+        if((response_size = response_feed(&reader, byte, 0)) >= 0)
+            break;
+    }
+
+    if(response_size < 0)
+        response_size = response_feed(&reader, 0, 1);
+    if(response_size >= 0)
+        reader.response[response_size] = 0;
+
+    memcpy(recv_buffer, reader.response, reader.size + 1);
+    return response_size;
+}
+
+/**
+ * Function: get_response_from_device
+ * ----------------------------
+ *  Send message to device and returns the message response generated by the device
+ *      @param[in] device_descriptor File descriptor of serial device
+ *      @param[in] buffer Buffed containing the message to send
+ *      @param[in] buffer_size Size of the buffer to send
+ *      @param[in] recv_buffer Empty buffer of size 256 for the message generated by the device
+ *      @param[in] timeout_ms Deadline for the response of this command in milliseconds
+ * 
+ *      @return Returns number of bytes of the response, without the line terminator
+ */
+
+int get_response_from_device(int device_descriptor, char* buffer, size_t buffer_size, char* recv_buffer, int timeout_ms) {
+
+    long long sent_at = monotonic_us();
+    int sent_bytes = send_message_to_device(device_descriptor, buffer, buffer_size);
+
+    if(sent_bytes == buffer_size) {
+
+        if(recv_buffer != NULL) { //Check the buffer to be allocated
+            int n = read_response_from_device(device_descriptor, recv_buffer, timeout_ms);
+            stats_command(buffer, recv_buffer, n, monotonic_us() - sent_at);
+            if(n >= 0) {
+                #ifdef DEBUG
+                    printf("DEBUG: Device has responded with %d bytes: %s\n", n, recv_buffer);
+                #endif
+            }
+            else {
+                printf("Error: no complete response from device in %d ms! (\"get_response_from_device::read\")\n", timeout_ms);
+                n = strlen(recv_buffer);
+            }
+            return n;   
+        } 
+    }
+    printf("Error %d while writing to the device! (\"get_response_from_device::write\")\n", errno);
+    return sent_bytes;
+}
+
+/**
+ * Function: stats_dump
+ * ----------------------------
+ *  Print the counters of the run, they keep changing while they are printed.
+ *      @param[in] output Stream of the dump
+ */
+
+void stats_dump(FILE* output) {
+
+    fprintf(output, "uptime %.3f s\n", (monotonic_us() - LINK_STATS.start_us) / 1e6);
+    for(int i = 0; i < DEVICE_COUNT; i++)
+        fprintf(output, "device %s at %d baud\n", DEVICES[i].name, DEVICES[i].baud);
+    fprintf(output, "tx %llu bytes in %lu writes\n", atomic_load(&LINK_STATS.tx_bytes), atomic_load(&LINK_STATS.tx_writes));
+    fprintf(output, "rx %llu bytes in %lu reads, %llu bytes of CMD mode responses\n", atomic_load(&LINK_STATS.rx_bytes),
+        atomic_load(&LINK_STATS.rx_reads), atomic_load(&LINK_STATS.rx_response_bytes));
+    fprintf(output, "frames %lu received, %lu damaged\n", atomic_load(&LINK_STATS.frames_received), atomic_load(&LINK_STATS.frames_damaged));
+    fprintf(output, "%-6s %8s %8s %8s %10s %10s %10s %10s\n", "cmd", "count", "errors", "timeouts", "p50 us", "p90 us", "p99 us", "max us");
+
+    for(int i = 0; i < STATS_COMMANDS; i++) {
+        struct command_stats* stats = &LINK_STATS.commands[i];
+        if(atomic_load(&stats->count) == 0)
+            continue;
+        fprintf(output, "%-6s %8lu %8lu %8lu %10llu %10llu %10llu %10llu\n", stats_command_names[i],
+            atomic_load(&stats->count), atomic_load(&stats->errors), atomic_load(&stats->timeouts),
+            histogram_percentile(&stats->latency, 50), histogram_percentile(&stats->latency, 90),
+            histogram_percentile(&stats->latency, 99), atomic_load(&stats->latency.max));
+    }
+    fflush(output);
+}
+
+/**
+ * Function: stats_write_file
+ * ----------------------------
+ *  Replace the stats file, readers never see a half written one.
+ *      @param[in] path Stats file
+ */
+
+void stats_write_file(const char* path) {
+
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    FILE* file = fopen(temporary, "w");
+    if(file == NULL)
+        return;
+    stats_dump(file);
+    fclose(file);
+    rename(temporary, path);
+}
+
+/**
+ * Function: thread_signals
+ * ----------------------------
+ *  Take the signals of the process and keep the stats file up to date. SIGINT, SIGTERM and SIGUSR1
+ *  are blocked in every thread and read from a signalfd here, nothing runs in a signal handler and
+ *  no system call of the other threads is interrupted. SIGINT and SIGTERM stop the run through
+ *  keep_running and SHUTDOWN_EVENT, SIGUSR1 dumps the counters.
+ *      @param[in] args Path of the stats file or NULL
+ */
+
+void* thread_signals(void* args) {
+
+    char* stats_path = (char*)args;
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+    if(signal_fd < 0 || timer_fd < 0) {
+        printf("Error %d while creating the signal descriptors! (\"thread_signals::signalfd\")\n", errno);
+        return NULL;
+    }
+
+    if(stats_path) {
+        struct itimerspec interval = {
+            { STATS_INTERVAL_MS / 1000, (STATS_INTERVAL_MS % 1000) * 1000000 },
+            { STATS_INTERVAL_MS / 1000, (STATS_INTERVAL_MS % 1000) * 1000000 }
+        };
+        timerfd_settime(timer_fd, 0, &interval, NULL);
+    }
+
+    struct pollfd fds[2] = { { .fd = signal_fd, .events = POLLIN }, { .fd = timer_fd, .events = POLLIN } };
+
+    while(1) {
+
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        if(fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if(read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                stats_write_file(stats_path);
+        }
+
+        struct signalfd_siginfo info;
+        if(!(fds[0].revents & POLLIN) || read(signal_fd, &info, sizeof(info)) != sizeof(info))
+            continue;
+
+        if(info.ssi_signo == SIGUSR1)
+            stats_dump(stderr);
+        else {
+            keep_running = 0;
+            printf(info.ssi_signo == SIGINT ? "Keyboard Interrupt!\n" : "Terminated!\n");
+            fflush(stdout);
+            eventfd_write(SHUTDOWN_EVENT, 1);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Function: start_signal_thread
+ * ----------------------------
+ *  Block the signals for the threads created from now on and start the thread taking them.
+ *      @param[in] stats_path Stats file or NULL
+ */
+
+void start_signal_thread(char* stats_path) {
+
+    pthread_t thread;
+    sigset_t signals;
+
+    LINK_STATS.start_us = monotonic_us();
+    LINK_STATS.path = stats_path;
+    SHUTDOWN_EVENT = eventfd(0, EFD_CLOEXEC);
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if(pthread_create(&thread, NULL, thread_signals, stats_path) == 0)
+        pthread_detach(thread);
+}
+
+/**
+ * Function: tx_batch_init
+ * ----------------------------
+ *  Initialize the outbound batching of a device.
+ *      @param[out] batch Outbound batch
+ *      @param[in] device Device the batch is written to
+ *      @param[in] flush_size Bytes after which the batch is written
+ *      @param[in] flush_delay_us Longest a message waits in the batch, 0 writes every message right away
+ */
+
+void tx_batch_init(struct tx_batch* batch, struct pmod_device* device, int flush_size, int flush_delay_us) {
+
+    memset(batch, 0, sizeof(*batch));
+    batch->device_descriptor = device->descriptor;
+    batch->baud = device->baud;
+    batch->flush_size = flush_size > 0 && flush_size <= TX_BATCH_CAPACITY ? flush_size : TX_BATCH_CAPACITY;
+    batch->flush_delay_us = flush_delay_us > 0 ? flush_delay_us : 0;
+    batch->flush_on_cr = 1;
+}
+
+/**
+ * Function: tx_batch_flush
+ * ----------------------------
+ *  Write the batch to the device with one send_message_to_device, waiting for room when the
+ *  device is non-blocking and full. With compression the batch goes out as one
+ *  FRAME_TYPE_DATA_LZ frame when that is smaller.
+ *      @param[in] batch Outbound batch
+ * 
+ *      @return 0 on success and -1 on error
+ */
+
+int tx_batch_flush(struct tx_batch* batch) {
+
+    int offset = 0;
+
+    if(batch->compress && batch->size > 0 && batch->size <= LZ_MAX_BLOCK_SIZE) {
+
+        unsigned char packed[FRAME_MAX_PAYLOAD];
+        int packed_size = lz_compress((unsigned char*)batch->buffer, batch->size, packed, sizeof(packed));
+
+        batch->compress_in += batch->size;
+        if(packed_size > 0 && FRAME_HEADER_SIZE + packed_size + FRAME_CRC_SIZE < batch->size) {
+            batch->size = frame_encode((unsigned char*)batch->buffer, FRAME_TYPE_DATA_LZ, packed, packed_size);
+            batch->compressed_blocks++;
+        }
+        else
+            batch->raw_blocks++;
+        batch->compress_out += batch->size;
+    }
+
+    while(offset < batch->size) {
+
+        int sent_bytes = send_message_to_device(batch->device_descriptor, batch->buffer + offset, batch->size - offset);
+
+        if(sent_bytes > 0) {
+            offset += sent_bytes;
+            continue;
+        }
+        if(sent_bytes < 0 && errno == EAGAIN) {
+            struct pollfd device_poll = { .fd = batch->device_descriptor, .events = POLLOUT };
+            poll(&device_poll, 1, -1);
+            continue;
+        }
+        if(sent_bytes < 0 && errno == EINTR)
+            continue;
+
+        printf("Error %d while writing to the device! (\"tx_batch_flush::write\")\n", errno);
+        batch->size = 0;
+        batch->messages_pending = 0;
+        return -1;
+    }
+
+    if(batch->size > 0) {
+        long long now = monotonic_us();
+        for(int i = 0; i < batch->messages_pending; i++)
+            histogram_add(&batch->added_latency, now - batch->enqueued_us[i]);
+        batch->writes++;
+        batch->bytes += batch->size;
+    }
+
+    batch->size = 0;
+    batch->messages_pending = 0;
+    return 0;
+}
+
+/**
+ * Function: tx_batch_send
+ * ----------------------------
+ *  Add a message to the batch. The batch is written right away when batching is off, when the
+ *  message holds a <cr> or is a barrier, or when the batch reached the flush size.
+ *      @param[in] batch Outbound batch
+ *      @param[in] message Message to send
+ *      @param[in] message_size Size of the message
+ *      @param[in] barrier Write everything up to and including this message now
+ * 
+ *      @return 0 on success and -1 on error
+ */
+
+int tx_batch_send(struct tx_batch* batch, char* message, int message_size, int barrier) {
+
+    if(batch->size + message_size > TX_BATCH_CAPACITY || batch->messages_pending == TX_BATCH_MAX_MESSAGES) {
+        if(tx_batch_flush(batch))
+            return -1;
+    }
+
+    /** Larger than a batch, nothing to merge */
+
+    if(message_size > TX_BATCH_CAPACITY) {
+        batch->messages++;
+        for(int offset = 0; offset < message_size; offset += TX_BATCH_CAPACITY) {
+            batch->size = message_size - offset < TX_BATCH_CAPACITY ? message_size - offset : TX_BATCH_CAPACITY;
+            memcpy(batch->buffer, message + offset, batch->size);
+            if(tx_batch_flush(batch))
+                return -1;
+        }
+        return 0;
+    }
+
+    memcpy(batch->buffer + batch->size, message, message_size);
+    batch->size += message_size;
+    batch->enqueued_us[batch->messages_pending++] = monotonic_us();
+    batch->messages++;
+
+    if(!batch->flush_delay_us || barrier || batch->size >= batch->flush_size || (batch->flush_on_cr && memchr(message, 0x0D, message_size)))
+        return tx_batch_flush(batch);
+    return 0;
+}
+
+/**
+ * Function: tx_batch_due_us
+ * ----------------------------
+ *  Time until the oldest message of the batch has waited the flush delay, for the poll timeouts.
+ *      @param[in] batch Outbound batch
+ * 
+ *      @return Microseconds until the batch has to be written, 0 if overdue, -1 if the batch is empty
+ */
+
+long long tx_batch_due_us(struct tx_batch* batch) {
+
+    if(batch->messages_pending == 0)
+        return -1;
+
+    long long due = batch->enqueued_us[0] + batch->flush_delay_us - monotonic_us();
+    return due > 0 ? due : 0;
+}
+
+/**
+ * Function: tx_batch_report
+ * ----------------------------
+ *  Print how many writes the batching saved and the latency it added to the messages.
+ *      @param[in] batch Outbound batch
+ *      @param[in] output Stream of the report
+ */
+
+void tx_batch_report(struct tx_batch* batch, FILE* output) {
+
+    if(batch->messages == 0)
+        return;
+
+    fprintf(output, "TX batching: %lu messages in %lu writes (%lu saved), %llu bytes, added latency p50 %llu us, p90 %llu us, p99 %llu us, max %llu us\n",
+        batch->messages, batch->writes, batch->messages > batch->writes ? batch->messages - batch->writes : 0, batch->bytes,
+        histogram_percentile(&batch->added_latency, 50), histogram_percentile(&batch->added_latency, 90),
+        histogram_percentile(&batch->added_latency, 99), batch->added_latency.max);
+
+    /** The link carries baud / 10 bytes per second, compression multiplies what that is worth */
+
+    if(batch->compress_out > 0)
+        fprintf(output, "Compression: %lu of %lu blocks compressed, %llu bytes sent as %llu (%.2f:1), up to %.1f kB/s of data at %d baud\n",
+            batch->compressed_blocks, batch->compressed_blocks + batch->raw_blocks, batch->compress_in, batch->compress_out,
+            (double)batch->compress_in / batch->compress_out, batch->baud / 10.0 * batch->compress_in / batch->compress_out / 1000, batch->baud);
+}
+
+/**
+ * Function: enter_device_cmd_mode
+ * ----------------------------
+ *  Set the device to CMD mode, prepare for sending commands.
+ *      @param[in] device_descriptor File descriptor of serial device
+ * 
+ *      @return 0 if the device entered the CMD mode succesfullt and 1 otherwise
+ */
+
+int enter_device_cmd_mode(int device_descriptor) {
+
+    char cmd_buffer[] = "$$$";
+    char* recv_buffer = malloc(sizeof(char) * 256);
+
+    get_response_from_device(device_descriptor, cmd_buffer, sizeof(cmd_buffer) - 1, recv_buffer, CMD_MODE_TIMEOUT_MS);
+    if(!strncmp(recv_buffer, "CMD", 3)) {
+        free(recv_buffer);
+        return 0;
+    }
+    free(recv_buffer);
+
+    printf("Device coudl be stuck in the CMD mode, try -e option first!\n");
+
+    return 1;
+}
+
+/**
+ * Function: exit_device_cmd_mode
+ * ----------------------------
+ *  Exit device CMD mode. ( ---<cr> )
+ *      @param[in] device_descriptor File descriptor of serial device
+ * 
+ *      @return 0 if the device entered the CMD mode succesfullt and 1 otherwise
+ */
+
+int exit_device_cmd_mode(int device_descriptor) {
+
+    char cmd_buffer[] = {'-', '-','-', 0x0D};
+    char* recv_buffer = malloc(sizeof(char) * 256);
+
+    get_response_from_device(device_descriptor, cmd_buffer, 4, recv_buffer, CMD_MODE_TIMEOUT_MS);
+    if(!strncmp(recv_buffer, "END", 3)) {
+        free(recv_buffer);
+        return 0;
+    }
+    free(recv_buffer);
+    return 1;
+}
+
+/**
+ * Function: session_init
+ * ----------------------------
+ *  Initialize a command session for the device, the device is expected to be in data mode.
+ *      @param[in] session Session to initialize
+ *      @param[in] device_descriptor File descriptor of serial device
+ */
+
+void session_init(struct cmd_session* session, int device_descriptor) {
+
+    memset(session, 0, sizeof(*session));
+    session->device_descriptor = device_descriptor;
+}
+
+/**
+ * Function: session_drain
+ * ----------------------------
+ *  Hand the data mode bytes already received to the drain of the session instead of
+ *  discarding them, e.g. to the subscribers of the daemon.
+ *      @param[in] session Command session in data mode with a drain
+ */
+
+void session_drain(struct cmd_session* session) {
+
+    struct pollfd device_poll = { .fd = session->device_descriptor, .events = POLLIN };
+    char buffer[256];
+
+    while(poll(&device_poll, 1, 0) > 0 && (device_poll.revents & POLLIN)) {
+        int recv_bytes = read(session->device_descriptor, buffer, sizeof(buffer));
+        if(recv_bytes <= 0)
+            break;
+        stats_count_rx(recv_bytes);
+        trace_write(&TRACE, TRACE_RX, buffer, recv_bytes);
+        session->drain(session->drain_context, buffer, recv_bytes);
+    }
+}
+
+/**
+ * Function: session_open
+ * ----------------------------
+ *  Make sure the session is in CMD mode. "$$$" is always sent alone since the module
+ *  needs the guard time around it, everything else can be pipelined.
+ *      @param[in] session Command session
+ * 
+ *      @return 0 if the device is in CMD mode and 1 otherwise
+ */
+
+int session_open(struct cmd_session* session) {
+
+    if(session->in_cmd_mode)
+        return 0;
+
+    /** Data mode bytes nobody has read yet would be taken as the response to $$$ */
+
+    if(session->drain)
+        session_drain(session);
+    else
+        tcflush(session->device_descriptor, TCIFLUSH);
+
+    if(enter_device_cmd_mode(session->device_descriptor))
+        return 1;
+
+    session->in_cmd_mode = 1;
+    return 0;
+}
+
+/**
+ * Function: session_queue
+ * ----------------------------
+ *  Queue a command on the session, the <cr> is added. Nothing is sent until session_flush.
+ *      @param[in] session Command session
+ *      @param[in] timeout_ms Deadline for the response of this command
+ *      @param[in] format printf like format of the command
+ * 
+ *      @return The request holding the response after session_flush or NULL if the pipeline is full
+ */
+
+struct cmd_request* session_queue(struct cmd_session* session, int timeout_ms, const char* format, ...) {
+
+    if(session->flushed) {
+        session->count = 0;
+        session->flushed = 0;
+    }
+
+    if(session->count == SESSION_MAX_COMMANDS) {
+        printf("Error: too many commands queued! (\"session_queue\")\n");
+        return NULL;
+    }
+
+    struct cmd_request* request = &session->requests[session->count++];
+    va_list args;
+
+    va_start(args, format);
+    request->command_size = vsnprintf(request->command, sizeof(request->command) - 1, format, args);
+    va_end(args);
+
+    if(request->command_size > (int)sizeof(request->command) - 2)
+        request->command_size = sizeof(request->command) - 2;
+    request->command[request->command_size++] = 0x0D;
+    request->command[request->command_size] = 0;
+    request->timeout_ms = timeout_ms;
+    request->response[0] = 0;
+    request->response_size = -1;
+
+    return request;
+}
+
+/**
+ * Function: session_track_mode
+ * ----------------------------
+ *  Follow the mode changes made by the pipeline itself, "---" and the reboot leave CMD mode.
+ *      @param[in] session Command session
+ *      @param[in] request Request that got its response
+ */
+
+void session_track_mode(struct cmd_session* session, struct cmd_request* request) {
+
+    if(!strncmp(request->command, "---", 3) && !strncmp(request->response, "END", 3))
+        session->in_cmd_mode = 0;
+    else if(!strncmp(request->command, "R,1", 3))
+        session->in_cmd_mode = 0;
+}
+
+/**
+ * Function: session_flush
+ * ----------------------------
+ *  Send all the queued commands in one write and read their responses in order.
+ *      @param[in] session Command session
+ * 
+ *      @return 0 if every request got its response and 1 otherwise
+ */
+
+int session_flush(struct cmd_session* session) {
+
+    char pipeline[SESSION_MAX_COMMANDS * 64];
+    int pipeline_size = 0;
+
+    if(session->flushed || session->count == 0)
+        return 0;
+    session->flushed = 1;
+
+    for(int i = 0; i < session->count; i++) {
+        memcpy(pipeline + pipeline_size, session->requests[i].command, session->requests[i].command_size);
+        pipeline_size += session->requests[i].command_size;
+    }
+
+    long long sent_at = monotonic_us();
+
+    if(send_message_to_device(session->device_descriptor, pipeline, pipeline_size) != pipeline_size) {
+        printf("Error %d while writing to the device! (\"session_flush::write\")\n", errno);
+        return 1;
+    }
+
+    for(int i = 0; i < session->count; i++) {
+
+        struct cmd_request* request = &session->requests[i];
+
+        request->response_size = read_response_from_device(session->device_descriptor, request->response, request->timeout_ms);
+
+        /** The module answers in order, a command is only worked on once the previous one is answered */
+
+        long long answered_at = monotonic_us();
+        stats_command(request->command, request->response, request->response_size, answered_at - sent_at);
+        sent_at = answered_at;
+
+        if(request->response_size < 0) {
+            request->command[request->command_size - 1] = 0;
+            printf("Error: no response from device to %s in %d ms! (\"session_flush::read\")\n", request->command, request->timeout_ms);
+            request->command[request->command_size - 1] = 0x0D;
+            return 1;
+        }
+
+        #ifdef DEBUG
+            printf("DEBUG: Device has responded to request %d with %d bytes: %s\n", i, request->response_size, request->response);
+        #endif
+
+        session_track_mode(session, request);
+    }
+    return 0;
+}
+
+/**
+ * Function: session_close
+ * ----------------------------
+ *  Flush what is still queued and leave CMD mode if the session is still in it.
+ *      @param[in] session Command session
+ * 
+ *      @return 0 if the device is back in data mode and 1 otherwise
+ */
+
+int session_close(struct cmd_session* session) {
+
+    session_flush(session);
+
+    if(!session->in_cmd_mode)
+        return 0;
+
+    if(exit_device_cmd_mode(session->device_descriptor))
+        return 1;
+
+    session->in_cmd_mode = 0;
+    return 0;
+}
+
+/**
+ * Function: restart_device
+ * ----------------------------
+ *  Queue the restart of the device.
+ * 
+ *      @param[in] session Command session in CMD mode
+ * 
+ *      @example R,1<cr> -> should echo Reboot!
+ */
+
+struct cmd_request* restart_device(struct cmd_session* session) {
+    return session_queue(session, ACTION_TIMEOUT_MS, "R,1");
+}
+
+/**
+ * Function: restore_default_baud
+ * ----------------------------
+ *  Switch the module and the tty back to 115200, the speed the next run expects.
+ *      @param[in] device Device running at another speed
+ * 
+ *      @return 0 on success and 1 otherwise
+ */
+
+int restore_default_baud(struct pmod_device* device) {
+
+    const struct baud_rate* rate = find_baud_rate(MODULE_DEFAULT_BAUD);
+    char command[16];
+    char response[256] = { 0 };
+
+    if(!device->session.in_cmd_mode && enter_device_cmd_mode(device->descriptor))
+        return 1;
+    device->session.in_cmd_mode = 1;
+
+    int command_size = snprintf(command, sizeof(command), "U,%s,N\r", rate->token);
+    get_response_from_device(device->descriptor, command, command_size, response, ACTION_TIMEOUT_MS);
+    if(strncmp(response, "AOK", 3)) {
+        printf("%s stays at %d baud until it is rebooted!\n", device->name, device->baud);
+        return 1;
+    }
+
+    /** The U command leaves CMD mode */
+
+    device->session.in_cmd_mode = 0;
+    set_serial_speed(device->descriptor, rate->speed);
+    device->baud = MODULE_DEFAULT_BAUD;
+    trace_note("tty at %d baud", rate->rate);
+    return 0;
+}
+
+/**
+ * Function: do_cleanup
+ * ----------------------------
+ *  Resets the deivce to normal mode and | or resets it to apply the changes
+ *      @param[in] device Device to leave as the next run expects it
+ * 
+ */
+
+int do_cleanup(struct pmod_device* device) {
+
+    if(LINK_STATS.path)
+        stats_write_file(LINK_STATS.path);
+
+    if(device->baud != MODULE_DEFAULT_BAUD && !restore_default_baud(device))
+        return 0;
+
+    if(device->session.in_cmd_mode) {
+        if(!exit_device_cmd_mode(device->descriptor)) {
+            device->session.in_cmd_mode = 0;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Function: connect_to_ble_address
+ * ----------------------------
+ *  Queue the connect to a given Bluetooth device by mac address.
+ *      @param[in] session Command session in CMD mode
+ *      @param[in] address Target device mac address
+ * 
+ *      @return The request, its response is AOK on success, ERR on error and ? on fatal error
+ * 
+ *      @example C,00A053112233<cr>
+ */
+
+struct cmd_request* connect_to_ble_address(struct cmd_session* session, char* address) {
+
+    #ifdef DEBUG
+        printf("DEBUG: Queueing connect command C,%s\n", address);
+    #endif
+
+    return session_queue(session, ACTION_TIMEOUT_MS, "C,%s", address);
+}
+
+/**
+ * Function: disconnect_from_ble
+ * ----------------------------
+ *  Queue the disconnect from the connected Bluetooth device.
+ *      @param[in] session Command session in CMD mode
+ * 
+ *      @return The request, its response is KILL on success
+ * 
+ *      @example K,<cr> -> should echo KILL<cl><lf>
+ */
+
+struct cmd_request* disconnect_from_ble(struct cmd_session* session) {
+    return session_queue(session, ACTION_TIMEOUT_MS, "K,");
+}
+
+
+/**
+ * Function: check_device_connected
+ * ----------------------------
+ *  Queue the connection status query.
+ *      @param[in] session Command session in CMD mode
+ * 
+ *      @return The request, its response is 1,0,0 if connected
+ * 
+ *      @example GK<cr> -> should echo 1,0,0 if connected
+ */
+
+struct cmd_request* check_device_connected(struct cmd_session* session) {
+    return session_queue(session, QUERY_TIMEOUT_MS, "GK");
+}
+
+/**
+ * Function: get_connected_address
+ * ----------------------------
+ *  Queue the query for the address of the connected device.
+ *      @param[in] session Command session in CMD mode
+ * 
+ *      @return The request, its response is the address of the connected device
+ * 
+ *      @example GR<cr> -> should echo the connected device address
+ */
+
+struct cmd_request* get_connected_address(struct cmd_session* session) {
+    return session_queue(session, QUERY_TIMEOUT_MS, "GR");
+}
+
+/**
+ * Function: queue_exit_device_cmd_mode
+ * ----------------------------
+ *  Queue the exit from CMD mode at the end of the pipeline. ( ---<cr> )
+ *      @param[in] session Command session in CMD mode
+ * 
+ *      @return The request, its response is END on success
+ */
+
+struct cmd_request* queue_exit_device_cmd_mode(struct cmd_session* session) {
+    return session_queue(session, CMD_MODE_TIMEOUT_MS, "---");
+}
+
+/**
+ * Function: probe_baud
+ * ----------------------------
+ *  Check that the module understands the current speed of the tty, "$$$" and "---" have to
+ *  get their CMD and END back.
+ *      @param[in] session Command session in data mode
+ * 
+ *      @return 0 if the module answered and 1 otherwise
+ */
+
+int probe_baud(struct cmd_session* session) {
+
+    tcflush(session->device_descriptor, TCIOFLUSH);
+
+    if(session_open(session))
+        return 1;
+
+    struct cmd_request* exit_request = queue_exit_device_cmd_mode(session);
+    if(session_flush(session) || strncmp(exit_request->response, "END", 3))
+        return 1;
+    return 0;
+}
+
+/**
+ * Function: negotiate_baud
+ * ----------------------------
+ *  Switch the module to another UART speed with the temporary U command, follow with the tty
+ *  and probe the link. When the probe fails the tty goes back to the old speed and the module
+ *  is probed there, it did not switch if it answers.
+ *      @param[in] device Device in data mode
+ *      @param[in] target Baud rate to switch to
+ * 
+ *      @return 0 if the link works at the new speed, 1 if it is back at the old speed and -1 if
+ *          the module answers at neither
+ * 
+ *      @example U,921K,N<cr> -> AOK, the module leaves CMD mode and switches
+ */
+
+int negotiate_baud(struct pmod_device* device, const struct baud_rate* target) {
+
+    struct cmd_session* session = &device->session;
+    const struct baud_rate* current = find_baud_rate(device->baud);
+
+    if(target->rate == current->rate)
+        return 0;
+
+    if(session_open(session))
+        return 1;
+
+    struct cmd_request* baud_request = session_queue(session, ACTION_TIMEOUT_MS, "U,%s,N", target->token);
+    session_flush(session);
+
+    if(strncmp(baud_request->response, "AOK", 3)) {
+        printf("The module refused %d baud: %s\n", target->rate, baud_request->response);
+        return session_close(session) ? -1 : 1;
+    }
+
+    session->in_cmd_mode = 0;
+
+    set_serial_speed(session->device_descriptor, target->speed);
+    trace_note("tty at %d baud", target->rate);
+    usleep(BAUD_SETTLE_MS * 1000);
+
+    if(!probe_baud(session)) {
+        device->baud = target->rate;
+        return 0;
+    }
+
+    printf("No answer at %d baud, going back to %d baud\n", target->rate, current->rate);
+
+    session->in_cmd_mode = 0;
+    set_serial_speed(session->device_descriptor, current->speed);
+    trace_note("tty at %d baud", current->rate);
+    usleep(BAUD_SETTLE_MS * 1000);
+
+    if(probe_baud(session)) {
+        session->in_cmd_mode = 0;
+        printf("The module does not answer at %d baud either, reboot it!\n", current->rate);
+        return -1;
+    }
+    return 1;
+}
+
+
+
+/**
+ * Function: fleet_send_pipeline
+ * ----------------------------
+ *  Write the queued commands of a device in CMD mode in one write, as session_flush does.
+ *      @param[in] device Device with queued requests
+ */
+
+void fleet_send_pipeline(struct pmod_device* device) {
+
+    struct cmd_session* session = &device->session;
+    char pipeline[SESSION_MAX_COMMANDS * 64];
+    int pipeline_size = 0;
+
+    for(int i = 0; i < session->count; i++) {
+        memcpy(pipeline + pipeline_size, session->requests[i].command, session->requests[i].command_size);
+        pipeline_size += session->requests[i].command_size;
+    }
+    session->flushed = 1;
+
+    device->fleet_state = FLEET_PIPELINE;
+    device->fleet_next = 0;
+    device->fleet_sent_us = monotonic_us();
+    device->fleet_deadline_ms = monotonic_ms() + session->requests[0].timeout_ms;
+    device->reader.size = 0;
+
+    if(send_message_to_device(device->descriptor, pipeline, pipeline_size) != pipeline_size) {
+        printf("Error %d while writing to %s! (\"fleet_send_pipeline::write\")\n", errno, device->name);
+        device->fleet_failed = 1;
+        device->fleet_state = FLEET_DONE;
+    }
+}
+
+/**
+ * Function: fleet_start
+ * ----------------------------
+ *  Start the queued pipeline of a device, "$$$" first when it is in data mode.
+ *      @param[in] device Device with queued requests
+ */
+
+void fleet_start(struct pmod_device* device) {
+
+    device->fleet_failed = 0;
+    device->fleet_started_us = monotonic_us();
+    device->fleet_done_us = 0;
+
+    if(device->session.flushed || device->session.count == 0) {
+        device->fleet_state = FLEET_DONE;
+        return;
+    }
+
+    if(device->session.in_cmd_mode) {
+        fleet_send_pipeline(device);
+        return;
+    }
+
+    /** Data mode bytes nobody has read yet would be taken as the response to $$$ */
+
+    tcflush(device->descriptor, TCIFLUSH);
+
+    device->fleet_state = FLEET_ENTER;
+    device->fleet_sent_us = monotonic_us();
+    device->fleet_deadline_ms = monotonic_ms() + CMD_MODE_TIMEOUT_MS;
+    device->reader.size = 0;
+
+    if(send_message_to_device(device->descriptor, "$$$", 3) != 3) {
+        printf("Error %d while writing to %s! (\"fleet_start::write\")\n", errno, device->name);
+        device->fleet_failed = 1;
+        device->fleet_state = FLEET_DONE;
+    }
+}
+
+/**
+ * Function: fleet_response
+ * ----------------------------
+ *  Take a complete response of a device, or its absence, and move on to the next request.
+ *      @param[in] device Device in the fleet loop
+ *      @param[in] response_size Length of the response in the reader, -1 if the deadline expired
+ */
+
+void fleet_response(struct pmod_device* device, int response_size) {
+
+    struct cmd_session* session = &device->session;
+    long long latency_us = monotonic_us() - device->fleet_sent_us;
+
+    if(response_size >= 0)
+        device->reader.response[response_size] = 0;
+
+    if(device->fleet_state == FLEET_ENTER) {
+        stats_command("$$$", device->reader.response, response_size, latency_us);
+        if(response_size < 0 || strncmp(device->reader.response, "CMD", 3)) {
+            printf("%s could be stuck in the CMD mode, try -e option first!\n", device->name);
+            device->fleet_failed = 1;
+            device->fleet_state = FLEET_DONE;
+            return;
+        }
+        session->in_cmd_mode = 1;
+        fleet_send_pipeline(device);
+        return;
+    }
+
+    struct cmd_request* request = &session->requests[device->fleet_next];
+
+    request->response_size = response_size;
+    memcpy(request->response, device->reader.response, sizeof(request->response));
+    stats_command(request->command, request->response, response_size, latency_us);
+
+    if(response_size < 0) {
+        request->command[request->command_size - 1] = 0;
+        printf("Error: no response from %s to %s in %d ms! (\"fleet_response\")\n", device->name, request->command, request->timeout_ms);
+        request->command[request->command_size - 1] = 0x0D;
+        device->fleet_failed = 1;
+        device->fleet_state = FLEET_DONE;
+        return;
+    }
+
+    session_track_mode(session, request);
+
+    /** The latency of the next request counts from this response, as in session_flush */
+
+    device->fleet_sent_us = monotonic_us();
+    device->reader.size = 0;
+    if(++device->fleet_next == session->count) {
+        device->fleet_state = FLEET_DONE;
+        device->fleet_done_us = monotonic_us();
+        return;
+    }
+    device->fleet_deadline_ms = monotonic_ms() + session->requests[device->fleet_next].timeout_ms;
+}
+
+/**
+ * Function: fleet_run
+ * ----------------------------
+ *  Run the queued pipelines of all the devices at once. One poll loop receives the responses of
+ *  every device byte by byte, each device follows its own requests and deadlines, so the fleet
+ *  takes about as long as its slowest device.
+ *      @param[in] devices Devices with queued requests
+ *      @param[in] count Number of devices
+ *
+ *      @return Number of devices that did not get every response
+ */
+
+int fleet_run(struct pmod_device* devices, int count) {
+
+    struct pollfd fds[MAX_DEVICES + 1];
+    int failed = 0;
+
+    for(int i = 0; i < count; i++)
+        fleet_start(&devices[i]);
+
+    while(1) {
+
+        long long now = monotonic_ms();
+        int timeout = -1, waiting = 0;
+
+        /** A response that could be complete only waits the grace time for more bytes */
+
+        for(int i = 0; i < count; i++) {
+            struct pmod_device* device = &devices[i];
+
+            fds[i].fd = device->fleet_state == FLEET_DONE ? -1 : device->descriptor;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            if(device->fleet_state == FLEET_DONE)
+                continue;
+
+            long long due = device->fleet_deadline_ms;
+            if(response_feed(&device->reader, 0, 1) >= 0 && device->fleet_last_byte_ms + RESPONSE_GRACE_MS < due)
+                due = device->fleet_last_byte_ms + RESPONSE_GRACE_MS;
+            if(timeout < 0 || due - now < timeout)
+                timeout = due > now ? due - now : 0;
+            waiting++;
+        }
+
+        if(!waiting)
+            break;
+
+        fds[count].fd = SHUTDOWN_EVENT;
+        fds[count].events = POLLIN;
+        fds[count].revents = 0;
+
+        int ready = poll(fds, count + 1, timeout);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready < 0) {
+            printf("Error %d while waiting for the devices! (\"fleet_run::poll\")\n", errno);
+            break;
+        }
+        if(fds[count].revents & POLLIN)
+            break;
+
+        now = monotonic_ms();
+
+        for(int i = 0; i < count; i++) {
+            struct pmod_device* device = &devices[i];
+            char byte;
+
+            if(device->fleet_state == FLEET_DONE)
+                continue;
+
+            /** Byte by byte, so nothing that follows the last response is consumed */
+
+            if((fds[i].revents & POLLIN) && read(device->descriptor, &byte, 1) == 1) {
+                stats_count_response(1);
+                trace_write(&TRACE, TRACE_RX, &byte, 1);
+                device->fleet_last_byte_ms = now;
+                int response_size = response_feed(&device->reader, byte, 0);
+                if(response_size >= 0)
+                    fleet_response(device, response_size);
+                continue;
+            }
+
+            /** Quiet for the grace time, past the deadline or gone */
+
+            int response_size = response_feed(&device->reader, 0, 1);
+            if((response_size >= 0 && now - device->fleet_last_byte_ms >= RESPONSE_GRACE_MS)
+                || now >= device->fleet_deadline_ms || (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)))
+                fleet_response(device, response_size);
+        }
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(devices[i].fleet_state != FLEET_DONE) {
+            devices[i].fleet_failed = 1;
+            devices[i].fleet_state = FLEET_DONE;
+        }
+        failed += devices[i].fleet_failed;
+    }
+    return failed;
+}
+
+/**
+ * Function: print_peer
+ * ----------------------------
+ *  Print a cached peer on one line.
+ *      @param[in] peer Cached peer
+ *      @param[in] now CLOCK_REALTIME seconds, for the age
+ */
+
+void print_peer(const struct peer* peer, int64_t now) {
+
+    char address[13];
+    char rssi[16] = "-";
+
+    peer_address_format(peer->address, address);
+    if(peer->rssi != PEER_RSSI_UNKNOWN)
+        snprintf(rssi, sizeof(rssi), "%d dBm", peer->rssi);
+
+    printf("%s  %-*s  class %06X  %8s  seen %lld s ago\n", address, PEER_NAME_SIZE - 12, peer->name[0] ? peer->name : "-",
+        peer->cod, rssi, (long long)(now - peer->seen));
+}
+
+/**
+ * Function: inquiry_line
+ * ----------------------------
+ *  Take a line of the inquiry, a result goes into the cache and is printed right away.
+ *      @param[in,out] cache Peer cache
+ *      @param[in] line Response line without the <cr><lf>
+ *      @param[in,out] found Results so far
+ *
+ *      @return 1 once the inquiry is done, -1 if the module refused it and 0 otherwise
+ */
+
+int inquiry_line(struct peer_cache* cache, char* line, int* found) {
+
+    struct peer peer;
+
+    if(!strncmp(line, "Inquiry Done", 12))
+        return 1;
+
+    if(!strcmp(line, "ERR") || !strcmp(line, "?")) {
+        printf("Error: the module refused the inquiry with %s! (\"inquiry_line\")\n", line);
+        return -1;
+    }
+
+    if(!peer_parse_result(line, &peer)) {
+        #ifdef DEBUG
+            printf("DEBUG: Inquiry: %s\n", line);
+        #endif
+        return 0;
+    }
+
+    peer.seen = time(NULL);
+    print_peer(peer_cache_update(cache, &peer), peer.seen);
+    fflush(stdout);
+    (*found)++;
+    return 0;
+}
+
+/**
+ * Function: run_inquiry
+ * ----------------------------
+ *  Scan for the peers in range and add them to the peer cache. The results are parsed as the
+ *  module sends them, each one is printed and cached as soon as its line is complete; the cache
+ *  file is written once at the end, SIGINT included.
+ *      @param[in] device Device in data mode
+ *      @param[in] seconds Scan time of IN
+ *      @param[in] rssi Scan with IQ for the RSSI instead of IN for the names
+ *      @param[in] cache_path Peer cache file
+ *      @param[in] ttl Seconds a peer is kept after it was seen
+ *
+ *      @return Number of peers found or -1 on error
+ */
+
+int run_inquiry(struct pmod_device* device, int seconds, int rssi, const char* cache_path, int ttl) {
+
+    struct peer_cache* cache = malloc(sizeof(struct peer_cache));
+    struct response_reader reader = { { 0 }, 0 };
+    char command[16];
+    char buffer[256];
+    int found = 0, status = 0;
+
+    if(peer_cache_load(cache, cache_path))
+        printf("Error %d while reading the peer cache %s, it is replaced! (\"run_inquiry::peer_cache_load\")\n", errno, cache_path);
+
+    if(session_open(&device->session)) {
+        free(cache);
+        return -1;
+    }
+
+    if(rssi)
+        seconds = INQUIRY_DEFAULT_SECONDS;
+    int command_size = rssi ? snprintf(command, sizeof(command), "IQ\r") : snprintf(command, sizeof(command), "IN,%d\r", seconds);
+
+    long long started = monotonic_us();
+    long long deadline = monotonic_ms() + seconds * 1000LL + (rssi ? CMD_MODE_TIMEOUT_MS : INQUIRY_NAMES_MS);
+    long long last_byte = 0;
+
+    if(send_message_to_device(device->descriptor, command, command_size) != command_size) {
+        printf("Error %d while writing to the device! (\"run_inquiry::write\")\n", errno);
+        status = -1;
+    }
+
+    while(status == 0) {
+
+        long long now = monotonic_ms();
+        if(now >= deadline) {
+            printf("Error: the inquiry did not end in %d s! (\"run_inquiry\")\n", (int)((deadline - started / 1000) / 1000));
+            status = -1;
+            break;
+        }
+
+        /** A line that could be complete only waits the grace time for more bytes */
+
+        long long due = deadline;
+        if(response_feed(&reader, 0, 1) >= 0 && last_byte + RESPONSE_GRACE_MS < due)
+            due = last_byte + RESPONSE_GRACE_MS;
+
+        struct pollfd fds[2] = { { .fd = device->descriptor, .events = POLLIN }, { .fd = SHUTDOWN_EVENT, .events = POLLIN } };
+        int ready = poll(fds, 2, due > now ? due - now : 0);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready < 0) {
+            printf("Error %d while waiting for the device! (\"run_inquiry::poll\")\n", errno);
+            status = -1;
+            break;
+        }
+        if(fds[1].revents & POLLIN)
+            break;
+
+        if(!(fds[0].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL))) {
+            int line_size = response_feed(&reader, 0, 1);
+            if(line_size >= 0 && monotonic_ms() - last_byte >= RESPONSE_GRACE_MS) {
+                reader.response[line_size] = 0;
+                status = inquiry_line(cache, reader.response, &found);
+                reader.size = 0;
+            }
+            continue;
+        }
+
+        ssize_t size = read(device->descriptor, buffer, sizeof(buffer));
+        if(size <= 0) {
+            printf("Error %d while reading from the device! (\"run_inquiry::read\")\n", errno);
+            status = -1;
+            break;
+        }
+        stats_count_response(size);
+        trace_write(&TRACE, TRACE_RX, buffer, size);
+        last_byte = monotonic_ms();
+
+        /** Nothing follows the last line before ---, a whole read can be taken */
+
+        for(ssize_t i = 0; i < size && status == 0; i++) {
+            int line_size = response_feed(&reader, buffer[i], 0);
+            if(line_size < 0)
+                continue;
+            reader.response[line_size] = 0;
+            status = inquiry_line(cache, reader.response, &found);
+            reader.size = 0;
+        }
+    }
+
+    if(status == 1)
+        stats_command(command, "Inquiry Done", 12, monotonic_us() - started);
+
+    session_close(&device->session);
+
+    if(peer_cache_save(cache, cache_path, time(NULL), ttl))
+        printf("Error %d while writing the peer cache %s! (\"run_inquiry::peer_cache_save\")\n", errno, cache_path);
+    else
+        printf("Inquiry: %d peers found in %.1f s, %u cached in %s\n", found, (monotonic_us() - started) / 1e6, cache->count, cache_path);
+
+    free(cache);
+    return status < 0 ? -1 : found;
+}
+
+/**
+ * Function: compare_peers_seen
+ * ----------------------------
+ *  qsort order of the peer list, the most recently seen first.
+ */
+
+int compare_peers_seen(const void* a, const void* b) {
+
+    const struct peer* first = a;
+    const struct peer* second = b;
+    return first->seen < second->seen ? 1 : first->seen > second->seen ? -1 : 0;
+}
+
+/**
+ * Function: print_peers
+ * ----------------------------
+ *  Print the peers of the cache that have not expired, the most recently seen first.
+ *      @param[in] cache_path Peer cache file
+ *      @param[in] ttl Seconds a peer is kept after it was seen
+ *
+ *      @return 0 on success and -1 if the cache could not be read
+ */
+
+int print_peers(const char* cache_path, int ttl) {
+
+    struct peer_cache* cache = malloc(sizeof(struct peer_cache));
+    int64_t now = time(NULL);
+    int printed = 0;
+
+    if(peer_cache_load(cache, cache_path)) {
+        printf("Error %d while reading the peer cache %s! (\"print_peers::peer_cache_load\")\n", errno, cache_path);
+        free(cache);
+        return -1;
+    }
+
+    qsort(cache->peers, cache->count, sizeof(struct peer), compare_peers_seen);
+    for(uint32_t i = 0; i < cache->count; i++) {
+        if(peer_expired(&cache->peers[i], now, ttl))
+            continue;
+        print_peer(&cache->peers[i], now);
+        printed++;
+    }
+
+    if(!printed)
+        printf("No peers in %s, scan with --inquiry first!\n", cache_path);
+    free(cache);
+    return 0;
+}
+
+/**
+ * Function: parse_target_address
+ * ----------------------------
+ *  Take a whole target as an address of 12 hex digits, with or without the brackets and the
+ *  separators. Unlike is_valid_mac_address the target is left as it is, an empty one included.
+ *      @param[in] target Target of a connect
+ *      @param[out] formatted_mac Address in 112233445566 format, 13 bytes
+ *
+ *      @return Length of the address without the brackets, 0 if the target is no address
+ */
+
+int parse_target_address(const char* target, char* formatted_mac) {
+
+    uint64_t address;
+    const char* text = target[0] == '[' ? target + 1 : target;
+    int size = peer_address_parse(text, &address);
+
+    if(size == 0 || (text[size] && (text[size] != ']' || target[0] != '[' || text[size + 1])))
+        return 0;
+
+    peer_address_format(address, formatted_mac);
+    return size;
+}
+
+/**
+ * Function: resolve_peer
+ * ----------------------------
+ *  Turn the target of --connect into the address for the module. An address of 12 hex digits,
+ *  with or without the brackets and separators, is taken as it is; anything else is looked up
+ *  by name or prefix in the peer cache, without a scan.
+ *      @param[in] target Address, name, name prefix or address prefix
+ *      @param[out] formatted_mac Address in 112233445566 format, 13 bytes
+ *      @param[out] label Target as it is reported
+ *      @param[in] label_size Size of label
+ *      @param[in] cache_path Peer cache file
+ *      @param[in] ttl Seconds a peer is kept after it was seen
+ *
+ *      @return 1 if the target stands for exactly one address and 0 otherwise
+ */
+
+int resolve_peer(char* target, char* formatted_mac, char* label, int label_size, const char* cache_path, int ttl) {
+
+    int size = parse_target_address(target, formatted_mac);
+
+    if(size > 0) {
+        snprintf(label, label_size, "%.*s", size, target + (target[0] == '['));
+        return 1;
+    }
+
+    struct peer_cache* cache = malloc(sizeof(struct peer_cache));
+    struct peer* matches[PEER_MAX_MATCHES];
+    int64_t now = time(NULL);
+
+    if(peer_cache_load(cache, cache_path)) {
+        printf("Error %d while reading the peer cache %s! (\"resolve_peer::peer_cache_load\")\n", errno, cache_path);
+        free(cache);
+        return 0;
+    }
+
+    int count = peer_cache_lookup(cache, target, now, ttl, matches, PEER_MAX_MATCHES);
+
+    if(count == 1) {
+        peer_address_format(matches[0]->address, formatted_mac);
+        if(matches[0]->name[0])
+            snprintf(label, label_size, "%s (%s)", matches[0]->name, formatted_mac);
+        else
+            snprintf(label, label_size, "%s", formatted_mac);
+    }
+    else if(count == 0)
+        printf("%s is neither an address nor a cached peer, scan with --inquiry first!\n", target);
+    else {
+        printf("%s matches %d peers, give more of the name or address:\n", target, count);
+        for(int i = 0; i < count && i < PEER_MAX_MATCHES; i++)
+            print_peer(matches[i], now);
+    }
+
+    free(cache);
+    return count == 1;
+}
+
+/**
+ * Function: oled_console_newline
+ * ----------------------------
+ *  Move the cursor to the start of the next line, scrolling by one line when it is on the last one.
+ *  The scroll moves the first page to the next row and clears the row that becomes the last line.
+ *      @param[in] console OLED console
+ */
+
+void oled_console_newline(struct oled_console* console) {
+
+    console->column = 0;
+
+    if(console->line < OLED_PAGES - 1) {
+        console->line++;
+        return;
+    }
+
+    console->top = (console->top + 1) % OLED_PAGES;
+    memset(console->rows[(console->top + OLED_PAGES - 1) % OLED_PAGES], 0, OLED_PAGE_SIZE);
+    console->scrolled = 1;
+}
+
+/**
+ * Function: oled_console_write
+ * ----------------------------
+ *  Append text to the console, only the glyphs of the new characters are rendered.
+ *  <cr>, <lf> and <cr><lf> end a line, lines longer than 16 characters wrap.
+ *  The display is mounted rotated, the first character of a line is the last cell of its page.
+ *      @param[in] console OLED console
+ *      @param[in] text Characters to append
+ *      @param[in] text_size Number of characters
+ */
+
+void oled_console_write(struct oled_console* console, char* text, int text_size) {
+
+    for(int i = 0; i < text_size; i++) {
+
+        unsigned char character = text[i];
+
+        if(character == 0x0D || (character == 0x0A && !console->after_cr)) {
+            oled_console_newline(console);
+            console->after_cr = character == 0x0D;
+            continue;
+        }
+        console->after_cr = 0;
+        if(character == 0x0A)
+            continue;
+
+        if(console->column == OLED_COLUMNS)
+            oled_console_newline(console);
+
+        int row = (console->top + console->line) % OLED_PAGES;
+        console->dirty_rows |= 1 << row;
+
+        /** A whole line in the text is blitted at once */
+
+        if(console->column == 0 && text_size - i >= OLED_COLUMNS
+            && !memchr(text + i, 0x0D, OLED_COLUMNS) && !memchr(text + i, 0x0A, OLED_COLUMNS)) {
+            oled_blit_row(console->rows[row], (unsigned char*)text + i);
+            console->column = OLED_COLUMNS;
+            i += OLED_COLUMNS - 1;
+            continue;
+        }
+
+        memcpy(console->rows[row] + (OLED_COLUMNS - 1 - console->column) * OLED_CELL_SIZE,
+            oledGlyphAtlas[character], OLED_CELL_SIZE);
+        console->column++;
+    }
+}
+
+/**
+ * Function: oled_console_compose
+ * ----------------------------
+ *  Copy the console lines that changed into the OLED frame, all of them after a scroll.
+ *      @param[in] console OLED console
+ *      @param[out] frame OLED frame of 512 bytes
+ */
+
+void oled_console_compose(struct oled_console* console, char* frame) {
+
+    for(int page = 0; page < OLED_PAGES; page++) {
+        int row = (console->top + page) % OLED_PAGES;
+        if(console->scrolled || (console->dirty_rows & (1 << row)))
+            memcpy(frame + page * OLED_PAGE_SIZE, console->rows[row], OLED_PAGE_SIZE);
+    }
+    console->scrolled = 0;
+    console->dirty_rows = 0;
+}
+
+/**
+ * Function: oled_open
+ * ----------------------------
+ *  Open the OLED device, the first update always writes the full frame.
+ *      @param[out] display OLED display
+ *      @param[in] path OLED device path
+ * 
+ *      @return 0 if the device was opened and -1 otherwise
+ */
+
+int oled_open(struct oled_display* display, const char* path) {
+
+    memset(display, 0, sizeof(*display));
+    display->partial_updates = 1;
+    display->fd = open(path, O_RDWR | O_NOCTTY | O_SYNC);
+    return display->fd < 0 ? -1 : 0;
+}
+
+/**
+ * Function: oled_update
+ * ----------------------------
+ *  Push the changes of the frame to the device. Every page with changes gets one pwrite()
+ *  from its first to its last changed glyph cell. When every page changed, or the driver
+ *  does not take writes at an offset, the full frame is written instead.
+ *      @param[in] display OLED display
+ * 
+ *      @return Number of bytes written to the device or -1 on error
+ */
+
+int oled_update(struct oled_display* display) {
+
+    int span_start[OLED_PAGES];
+    int span_end[OLED_PAGES];
+    int dirty_pages = 0;
+
+    for(int page = 0; page < OLED_PAGES; page++) {
+
+        int page_offset = page * OLED_PAGE_SIZE;
+
+        span_start[page] = -1;
+        span_end[page] = -1;
+        for(int cell = page_offset; cell < page_offset + OLED_PAGE_SIZE; cell += OLED_CELL_SIZE) {
+            if(display->shown_valid && !memcmp(display->frame + cell, display->shown + cell, OLED_CELL_SIZE))
+                continue;
+            if(span_start[page] < 0)
+                span_start[page] = cell;
+            span_end[page] = cell + OLED_CELL_SIZE;
+        }
+        dirty_pages += span_start[page] >= 0;
+    }
+
+    if(dirty_pages == 0)
+        return 0;
+
+    int written = 0;
+
+    if(display->partial_updates && dirty_pages < OLED_PAGES) {
+
+        for(int page = 0; page < OLED_PAGES && written >= 0; page++) {
+
+            if(span_start[page] < 0)
+                continue;
+
+            int span_size = span_end[page] - span_start[page];
+
+            if(pwrite(display->fd, display->frame + span_start[page], span_size, span_start[page]) != span_size) {
+
+                #ifdef DEBUG
+                    printf("DEBUG: Error %d on partial OLED update, using full frames\n", errno);
+                #endif
+
+                display->partial_updates = 0;
+                written = -1;
+                break;
+            }
+            written += span_size;
+        }
+    }
+
+    if(!display->partial_updates || dirty_pages == OLED_PAGES) {
+
+        if(lseek(display->fd, 0, SEEK_SET) < 0 && errno != ESPIPE)
+            return -1;
+        if(write(display->fd, display->frame, OLED_FRAME_SIZE) != OLED_FRAME_SIZE)
+            return -1;
+
+        written = (written > 0 ? written : 0) + OLED_FRAME_SIZE;
+        display->full_frames++;
+    }
+
+    memcpy(display->shown, display->frame, OLED_FRAME_SIZE);
+    display->shown_valid = 1;
+    display->updates++;
+    display->bytes_written += written;
+    return written;
+}
+
+/**
+ * Function: rx_ring_push
+ * ----------------------------
+ *  Copy bytes into the receive ring and wake up the consumers, what does not fit is counted as dropped.
+ *      @param[in] ring Receive ring
+ *      @param[in] data Bytes to publish
+ *      @param[in] size Number of bytes
+ */
+
+void rx_ring_push(struct rx_ring* ring, const unsigned char* data, int size) {
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t used = head - atomic_load_explicit(&ring->tail[RX_CONSOLE], memory_order_acquire);
+
+    if(size > (int)(RX_RING_SIZE - used)) {
+        atomic_fetch_add_explicit(&ring->dropped, size - (RX_RING_SIZE - used), memory_order_relaxed);
+        size = RX_RING_SIZE - used;
+    }
+    if(size == 0)
+        return;
+
+    size_t offset = head & (RX_RING_SIZE - 1);
+    size_t contiguous = RX_RING_SIZE - offset;
+
+    if((size_t)size <= contiguous)
+        memcpy(ring->data + offset, data, size);
+    else {
+        memcpy(ring->data + offset, data, contiguous);
+        memcpy(ring->data, data + contiguous, size - contiguous);
+    }
+
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+
+    if(used + size > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+        atomic_store_explicit(&ring->high_water, used + size, memory_order_relaxed);
+
+    for(int i = 0; i < RX_CONSUMERS; i++)
+        eventfd_write(ring->wakeup[i], 1);
+    eventfd_write(ring->received, 1);
+}
+
+/**
+ * Function: rx_handle_frame
+ * ----------------------------
+ *  Handle a frame of the reader. Data goes into the ring, a compressed block is inflated and its
+ *  frames handled in turn, a HELLO of the peer is remembered and answered when it asks for it.
+ *      @param[in] ring Receive ring
+ *      @param[in] frame Decoded frame
+ */
+
+void rx_handle_frame(struct rx_ring* ring, struct frame* frame) {
+
+    #ifdef DEBUG
+        printf("DEBUG: Frame of type %d with %d bytes\n", frame->type, frame->size);
+    #endif
+
+    if(frame->type == FRAME_TYPE_DATA)
+        rx_ring_push(ring, frame->payload, frame->size);
+
+    else if(frame->type == FRAME_TYPE_DATA_LZ) {
+
+        unsigned char block[LZ_MAX_BLOCK_SIZE];
+        int block_size = lz_decompress(frame->payload, frame->size, block, sizeof(block));
+        const unsigned char* input = block;
+        struct frame inner;
+
+        if(block_size < 0) {
+            ring->decoder.crc_errors++; // Passed the CRC but does not inflate, count it with the damaged frames
+            return;
+        }
+        ring->inflated_blocks++;
+        ring->inflated_in += frame->size;
+        ring->inflated_out += block_size;
+
+        while(block_size > 0 && frame_decode(&ring->inflated, &input, &block_size, &inner))
+            if(inner.type == FRAME_TYPE_DATA)
+                rx_ring_push(ring, inner.payload, inner.size);
+    }
+
+    else if(frame->type == FRAME_TYPE_HELLO && frame->size >= 2) {
+
+        atomic_store(&ring->peer_capabilities, frame->payload[0]);
+        eventfd_write(ring->received, 1);
+
+        /** A single small write, the tty does not interleave it with the writes of the main thread */
+
+        if(frame->payload[1]) {
+            unsigned char hello[2] = { FRAME_CAP_LZ, 0 };
+            unsigned char reply[FRAME_HEADER_SIZE + sizeof(hello) + FRAME_CRC_SIZE];
+            int reply_size = frame_encode(reply, FRAME_TYPE_HELLO, hello, sizeof(hello));
+            send_message_to_device(ring->device_descriptor, (char*)reply, reply_size);
+        }
+    }
+}
+
+/**
+ * Function: rt_lock_memory
+ * ----------------------------
+ *  Lock the pages of the process so the reader never waits for a page to come back from swap.
+ *  Within a memory lock limit the later allocations would fail once it is reached, only the
+ *  pages mapped up to now are locked then.
+ */
+
+void rt_lock_memory(void) {
+
+    struct rlimit limit;
+    int flags = MCL_CURRENT | MCL_FUTURE;
+
+    if(geteuid() != 0 && getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        flags = MCL_CURRENT;
+
+    if(mlockall(flags))
+        fprintf(stderr, "Memory not locked (%s), pages can still be swapped out\n", strerror(errno));
+    else if(!(flags & MCL_FUTURE))
+        fprintf(stderr, "Memory locked as mapped now, the lock limit of %llu kB leaves the later allocations unlocked\n",
+            (unsigned long long)limit.rlim_cur / 1024);
+}
+
+/**
+ * Function: rt_apply
+ * ----------------------------
+ *  Pin the calling thread to the CPU of --cpu and run it under SCHED_FIFO. A setting the process
+ *  has no privilege for is reported and left out, the thread runs on as before.
+ *      @param[in] role Name of the thread in the report, e.g. Reader
+ *      @param[in] priority SCHED_FIFO priority, 0 keeps the normal scheduler
+ */
+
+void rt_apply(const char* role, int priority) {
+
+    int pinned = 0, fifo = 0;
+
+    if(RT.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(RT.cpu, &cpus);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if(error)
+            fprintf(stderr, "%s not pinned to CPU %d (%s), it runs on any CPU\n", role, RT.cpu, strerror(error));
+        pinned = !error;
+    }
+
+    if(priority > 0) {
+        struct sched_param param = { .sched_priority = priority };
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(error)
+            fprintf(stderr, "%s not given SCHED_FIFO %d (%s), it keeps the normal scheduler\n", role, priority, strerror(error));
+        fifo = !error;
+    }
+
+    if(fifo || pinned) {
+        fprintf(stderr, "%s:", role);
+        if(fifo)
+            fprintf(stderr, " SCHED_FIFO %d", priority);
+        if(pinned)
+            fprintf(stderr, " on CPU %d", RT.cpu);
+        fprintf(stderr, "\n");
+    }
+}
+
+/**
+ * Function: thread_pooling_module
+ * ----------------------------
+ *  Thread function in polling mode, blocks in poll() until the device descriptor is readable
+ *  and reads straight into the receive ring, so draining the UART never waits for the console
+ *  or the OLED. An idle link causes no wakeups.
+ *  It returns once ring->stop is signalled.
+ *      @param[in] args receive ring
+ * 
+ */
+
+void* thread_pooling_module(void* args) {
+
+    struct rx_ring* ring = (struct rx_ring*)args;
+    char overflow_buffer[256];
+
+    rt_apply("Reader", RT.priority);
+
+    struct pollfd fds[2] = {
+        { .fd = ring->device_descriptor, .events = POLLIN },
+        { .fd = ring->stop, .events = POLLIN }
+    };
+
+    while(1) {
+
+        /** Wait without timeout, the thread only wakes up when there is something to read or it is stopped */
+
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            printf("Error %d while waiting for device! (\"thread_pooling_module::poll\")\n", errno);
+            break;
+        }
+
+        if(fds[1].revents & POLLIN)
+            break;
+
+        if(!(fds[0].revents & POLLIN)) {
+            printf("\nPmodBT2 Device has hung up!\n");
+            break;
+        }
+
+        /** Framed, the frames can span reads and a read can end several frames */
+
+        if(ring->framed) {
+            unsigned char frame_input[4096];
+            int recv_bytes = read(ring->device_descriptor, frame_input,
+                TTY_PROFILE->read_chunk < (int)sizeof(frame_input) ? TTY_PROFILE->read_chunk : (int)sizeof(frame_input));
+            const unsigned char* input = frame_input;
+            struct frame frame;
+
+            stats_count_rx(recv_bytes);
+            trace_write(&TRACE, TRACE_RX, frame_input, recv_bytes);
+            while(recv_bytes > 0 && link_frame_decode(&ring->decoder, &input, &recv_bytes, &frame))
+                rx_handle_frame(ring, &frame);
+            continue;
+        }
+
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t used = head - atomic_load_explicit(&ring->tail[RX_CONSOLE], memory_order_acquire);
+
+        /** Keep draining the device when the ring is full, what can not be stored is counted */
+
+        if(used == RX_RING_SIZE) {
+            int recv_bytes = read(ring->device_descriptor, overflow_buffer, sizeof(overflow_buffer));
+            stats_count_rx(recv_bytes);
+            trace_write(&TRACE, TRACE_RX, overflow_buffer, recv_bytes);
+            if(recv_bytes > 0)
+                atomic_fetch_add_explicit(&ring->dropped, recv_bytes, memory_order_relaxed);
+            continue;
+        }
+
+        size_t offset = head & (RX_RING_SIZE - 1);
+        size_t contiguous = RX_RING_SIZE - offset;
+        if(contiguous > RX_RING_SIZE - used)
+            contiguous = RX_RING_SIZE - used;
+        if(contiguous > (size_t)TTY_PROFILE->read_chunk)
+            contiguous = TTY_PROFILE->read_chunk;
+
+        int recv_bytes = read(ring->device_descriptor, ring->data + offset, contiguous);
+        stats_count_rx(recv_bytes);
+        trace_write(&TRACE, TRACE_RX, ring->data + offset, recv_bytes);
+
+        if(recv_bytes > 0) {
+
+            atomic_store_explicit(&ring->head, head + recv_bytes, memory_order_release);
+
+            if(used + recv_bytes > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+                atomic_store_explicit(&ring->high_water, used + recv_bytes, memory_order_relaxed);
+
+            for(int i = 0; i < RX_CONSUMERS; i++)
+                eventfd_write(ring->wakeup[i], 1);
+            eventfd_write(ring->received, 1);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Function: thread_console_output
+ * ----------------------------
+ *  Consumer of the receive ring, prints everything the device sends.
+ *      @param[in] args receive ring
+ * 
+ */
+
+void* thread_console_output(void* args) {
+
+    struct rx_ring* ring = (struct rx_ring*)args;
+    eventfd_t published;
+
+    while(eventfd_read(ring->wakeup[RX_CONSOLE], &published) == 0 || errno == EINTR) {
+
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail[RX_CONSOLE], memory_order_relaxed);
+
+        /** Stopped after the reader, so everything it published has been printed */
+
+        if(head == tail && atomic_load(&ring->stopping))
+            break;
+        if(head == tail)
+            continue;
+
+        printf("\nPmodBT2 Responded > ");
+
+        while(tail != head) {
+            size_t offset = tail & (RX_RING_SIZE - 1);
+            size_t contiguous = RX_RING_SIZE - offset;
+            if(contiguous > head - tail)
+                contiguous = head - tail;
+
+            fwrite(ring->data + offset, 1, contiguous, stdout);
+            tail += contiguous;
+            atomic_store_explicit(&ring->tail[RX_CONSOLE], tail, memory_order_release);
+        }
+
+        fflush(stdout); // The response has no trailing newline, do not wait for the next one to show it
+
+        if(atomic_load(&ring->stopping))
+            break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Function: thread_oled_output
+ * ----------------------------
+ *  Consumer of the receive ring, appends the received characters to the OLED console. When the
+ *  synchronous display writes fall behind, the oldest bytes of the backlog are skipped.
+ *      @param[in] args receive ring
+ * 
+ */
+
+void* thread_oled_output(void* args) {
+
+    struct rx_ring* ring = (struct rx_ring*)args;
+    char text[RX_DISPLAY_BYTES];
+    eventfd_t published;
+
+    while(eventfd_read(ring->wakeup[RX_DISPLAY], &published) == 0 || errno == EINTR) {
+
+        if(atomic_load(&ring->stopping))
+            break; // The display is not worth a last update at exit
+
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t tail = head - atomic_load_explicit(&ring->tail[RX_DISPLAY], memory_order_relaxed) > RX_DISPLAY_BYTES ?
+            head - RX_DISPLAY_BYTES : atomic_load_explicit(&ring->tail[RX_DISPLAY], memory_order_relaxed);
+        int text_size = head - tail;
+
+        if(text_size == 0)
+            continue;
+
+        for(int i = 0; i < text_size; i++)
+            text[i] = ring->data[(tail + i) & (RX_RING_SIZE - 1)];
+
+        /**
+         * The producer only waits for the console and stores its bytes before it publishes the head, so a
+         * read in progress may already overwrite up to a chunk past the head, but never past the console
+         * tail. Drop the copy if any of it can have been overwritten meanwhile.
+         */
+
+        atomic_thread_fence(memory_order_acquire);
+        size_t written = atomic_load_explicit(&ring->head, memory_order_relaxed) + (ring->framed ? FRAME_MAX_PAYLOAD : TTY_PROFILE->read_chunk);
+        size_t writable = atomic_load_explicit(&ring->tail[RX_CONSOLE], memory_order_relaxed) + RX_RING_SIZE;
+
+        if((written < writable ? written : writable) - tail > RX_RING_SIZE)
+            continue;
+
+        atomic_store_explicit(&ring->tail[RX_DISPLAY], head, memory_order_relaxed);
+
+        pthread_mutex_lock(&ring->console_lock);
+        oled_console_write(&ring->console, text, text_size);
+        ring->console_writes++;
+        ring->console_pending = 1;
+        pthread_cond_signal(&ring->console_changed);
+        pthread_mutex_unlock(&ring->console_lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Function: thread_oled_writer
+ * ----------------------------
+ *  Frame paced OLED writer. Waits for console changes, composes the latest console state into
+ *  the frame and pushes it to the display, at most once per frame period. All the changes made
+ *  while a frame is written or paced are coalesced into the next one.
+ *      @param[in] args receive ring
+ * 
+ */
+
+void* thread_oled_writer(void* args) {
+
+    struct rx_ring* ring = (struct rx_ring*)args;
+    struct timespec next_frame;
+
+    if(RT.display)
+        rt_apply("Display writer", RT.priority > 1 ? RT.priority - 1 : RT.priority);
+
+    oled_open(&ring->display, ring->oled_name);
+    clock_gettime(CLOCK_MONOTONIC, &next_frame);
+
+    while(1) {
+
+        pthread_mutex_lock(&ring->console_lock);
+        while(!ring->console_pending && !atomic_load(&ring->stopping))
+            pthread_cond_wait(&ring->console_changed, &ring->console_lock);
+        if(atomic_load(&ring->stopping)) {
+            pthread_mutex_unlock(&ring->console_lock);
+            break;
+        }
+        oled_console_compose(&ring->console, ring->display.frame);
+        ring->console_pending = 0;
+        pthread_mutex_unlock(&ring->console_lock);
+
+        /** The frame is only touched by this thread, the console can change during the write */
+
+        oled_update(&ring->display);
+
+        next_frame.tv_nsec += ring->frame_period_us * 1000L;
+        while(next_frame.tv_nsec >= 1000000000L) {
+            next_frame.tv_nsec -= 1000000000L;
+            next_frame.tv_sec++;
+        }
+
+        /** After an idle period the next frame is due right away */
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(now.tv_sec > next_frame.tv_sec || (now.tv_sec == next_frame.tv_sec && now.tv_nsec > next_frame.tv_nsec))
+            next_frame = now;
+        else
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_frame, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * Function: start_receive_threads
+ * ----------------------------
+ *  Create the receive ring for the device, the UART reader, its consumers and the OLED writer.
+ *      @param[in] device_descriptor File descriptor of serial device
+ *      @param[in] oled_name OLED device path
+ *      @param[in] oled_fps Maximum frame rate of the OLED
+ *      @param[in] framed The device sends frames, see uartFrame.h
+ *      @param[out] threads The reader, the RX_CONSUMERS consumers and the OLED writer
+ * 
+ *      @return The receive ring or NULL if it could not be created
+ */
+
+struct rx_ring* start_receive_threads(int device_descriptor, char* oled_name, int oled_fps, int framed, pthread_t* threads) {
+
+    struct rx_ring* ring = calloc(1, sizeof(struct rx_ring));
+    if(ring == NULL)
+        return NULL;
+
+    ring->device_descriptor = device_descriptor;
+    ring->oled_name = oled_name;
+    ring->display.fd = -1;
+    ring->framed = framed;
+    atomic_init(&ring->peer_capabilities, -1);
+    ring->frame_period_us = 1000000 / (oled_fps > 0 ? oled_fps : OLED_DEFAULT_FPS);
+    pthread_mutex_init(&ring->console_lock, NULL);
+    pthread_cond_init(&ring->console_changed, NULL);
+    for(int i = 0; i < RX_CONSUMERS; i++)
+        ring->wakeup[i] = eventfd(0, EFD_CLOEXEC);
+    ring->received = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring->stop = eventfd(0, EFD_CLOEXEC);
+
+    pthread_create(&threads[RX_THREADS - 1], NULL, thread_oled_writer, ring);
+    pthread_create(&threads[1 + RX_CONSOLE], NULL, thread_console_output, ring);
+    pthread_create(&threads[1 + RX_DISPLAY], NULL, thread_oled_output, ring);
+    pthread_create(&threads[0], NULL, thread_pooling_module, ring);
+
+    return ring;
+}
+
+/**
+ * Function: stop_receive_threads
+ * ----------------------------
+ *  Stop the receive threads, report how full the receive ring has been and how the OLED was updated.
+ *      @param[in] ring Receive ring
+ *      @param[in] threads The reader, the RX_CONSUMERS consumers and the OLED writer
+ */
+
+void stop_receive_threads(struct rx_ring* ring, pthread_t* threads) {
+
+    /** The reader first, the consumers then find everything it has published */
+
+    eventfd_write(ring->stop, 1);
+    pthread_join(threads[0], NULL);
+
+    atomic_store(&ring->stopping, 1);
+    for(int i = 0; i < RX_CONSUMERS; i++)
+        eventfd_write(ring->wakeup[i], 1);
+    pthread_mutex_lock(&ring->console_lock);
+    pthread_cond_signal(&ring->console_changed);
+    pthread_mutex_unlock(&ring->console_lock);
+
+    #ifdef DEBUG
+        printf("DEBUG: Threads have been stopped, waiting for join!\n");
+    #endif
+
+    for(int i = 1; i < RX_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    printf("Receive ring: high water %zu of %d bytes, %zu bytes dropped\n",
+        atomic_load(&ring->high_water), RX_RING_SIZE, atomic_load(&ring->dropped));
+
+    if(ring->framed)
+        printf("Frames: %lu received, %lu CRC errors, %lu bad lengths, %llu bytes skipped\n",
+            ring->decoder.frames, ring->decoder.crc_errors, ring->decoder.length_errors, ring->decoder.skipped_bytes);
+
+    if(ring->inflated_blocks > 0)
+        printf("Inflated: %lu blocks, %llu bytes received as %llu (%.2f:1)\n",
+            ring->inflated_blocks, ring->inflated_out, ring->inflated_in, (double)ring->inflated_out / ring->inflated_in);
+
+    if(ring->display.fd >= 0) {
+        printf("OLED: %lu console changes in %lu updates, %lu bytes written, %lu full frames\n",
+            ring->console_writes, ring->display.updates, ring->display.bytes_written, ring->display.full_frames);
+        close(ring->display.fd);
+    }
+
+    for(int i = 0; i < RX_CONSUMERS; i++)
+        close(ring->wakeup[i]);
+    close(ring->received);
+    close(ring->stop);
+    pthread_mutex_destroy(&ring->console_lock);
+    pthread_cond_destroy(&ring->console_changed);
+    free(ring);
+}
+
+/**
+ * Function: run_jitter
+ * ----------------------------
+ *  Measure how late the device reader would wake up with the scheduling of --rt-prio and --cpu:
+ *  sleep to an absolute deadline every JITTER_PERIOD_US and count how late each wakeup is. Run it
+ *  with and without the options under the usual load of the board to see what they gain.
+ *      @param[in] seconds Length of the measurement
+ *
+ *      @return 0 on success and -1 on error
+ */
+
+int run_jitter(int seconds) {
+
+    struct latency_histogram* late = calloc(1, sizeof(struct latency_histogram));
+    struct timespec deadline;
+
+    if(late == NULL)
+        return -1;
+
+    rt_apply("Jitter probe", RT.priority);
+    printf("Wakeup jitter: every %d us for %d s, CTRL-C stops earlier\n", JITTER_PERIOD_US, seconds);
+
+    long long end = monotonic_us() + seconds * 1000000LL;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    while(keep_running && monotonic_us() < end) {
+
+        deadline.tv_nsec += JITTER_PERIOD_US * 1000L;
+        while(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_nsec -= 1000000000L;
+            deadline.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long late_ns = (now.tv_sec - deadline.tv_sec) * 1000000000LL + now.tv_nsec - deadline.tv_nsec;
+        histogram_add(late, late_ns > 0 ? late_ns / 1000 : 0);
+
+        /** After a stall longer than the period, go on from now instead of catching up */
+
+        if(late_ns > JITTER_PERIOD_US * 1000LL)
+            deadline = now;
+    }
+
+    printf("Late by: p50 %llu us, p90 %llu us, p99 %llu us, p99.9 %llu us, max %llu us over %lu wakeups\n",
+        histogram_percentile(late, 50), histogram_percentile(late, 90), histogram_percentile(late, 99),
+        histogram_percentile(late, 99.9), (unsigned long long)late->max, (unsigned long)late->samples);
+
+    /** One row per used bucket, the bar is relative to the fullest one */
+
+    unsigned long fullest = 0;
+    for(int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+        if(late->counts[bucket] > fullest)
+            fullest = late->counts[bucket];
+
+    for(int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        unsigned long count = late->counts[bucket];
+        if(count == 0)
+            continue;
+        char bar[51];
+        int width = count * 50 / fullest;
+        memset(bar, '#', width);
+        bar[width] = 0;
+        printf("  <= %8llu us %10lu %s\n", histogram_bucket_upper(bucket), count, bar);
+    }
+
+    free(late);
+    return 0;
+}
+
+/**
+ * Function: write_all
+ * ----------------------------
+ *  Write the whole buffer to a blocking descriptor.
+ * 
+ *      @return 0 on success and -1 on error
+ */
+
+int write_all(int fd, char* buffer, ssize_t size) {
+
+    while(size > 0) {
+        ssize_t written = write(fd, buffer, size);
+        if(written < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/**
+ * Function: raw_pipe
+ * ----------------------------
+ *  Move stdin to the device and the device to stdout unchanged until stdin ends or SIGINT.
+ *  The device is non-blocking so a long write never stops the draining of the device.
+ *  splice() is used in each direction while the kernel supports it for the descriptors
+ *  (one side has to be a pipe), read() and write() otherwise, in the chunk sizes of the tty
+ *  profile. VMIN and VTIME do not apply to the non-blocking device. With a flush delay the
+ *  stdin reads go through the outbound batch instead, so a chatty producer is merged into
+ *  fewer writes.
+ *      @param[in] device_descriptor File descriptor of serial device
+ *      @param[in] batch Outbound batch of the device
+ * 
+ *      @return 0 on success and -1 on error
+ */
+
+int raw_pipe(int device_descriptor, struct tx_batch* batch) {
+
+    char* to_device = malloc(RAW_CHUNK_SIZE);
+    char* from_device = malloc(RAW_CHUNK_SIZE);
+    ssize_t pending = 0, pending_offset = 0;
+    unsigned long long sent = 0, received = 0;
+    int splice_in = !batch->flush_delay_us && !TRACE.header, splice_out = !TRACE.header; // Spliced bytes can not be captured
+    int stdin_open = 1, device_full = 0, status = 0;
+    long long start = monotonic_ms();
+
+    int device_flags = fcntl(device_descriptor, F_GETFL);
+    fcntl(device_descriptor, F_SETFL, device_flags | O_NONBLOCK);
+
+    while(keep_running) {
+
+        struct pollfd fds[3] = {
+            { .fd = stdin_open && !device_full && !pending ? STDIN_FILENO : -1, .events = POLLIN },
+            { .fd = device_descriptor, .events = POLLIN | (device_full ? POLLOUT : 0) },
+            { .fd = SHUTDOWN_EVENT, .events = POLLIN }
+        };
+
+        if(!stdin_open && !pending)
+            tcdrain(device_descriptor);
+
+        struct timespec timeout = { RAW_LINGER_MS / 1000, (RAW_LINGER_MS % 1000) * 1000000 };
+        long long due_us = tx_batch_due_us(batch);
+        if(due_us >= 0) {
+            timeout.tv_sec = due_us / 1000000;
+            timeout.tv_nsec = (due_us % 1000000) * 1000;
+        }
+
+        int ready = ppoll(fds, 3, stdin_open || pending ? (due_us >= 0 ? &timeout : NULL) : &timeout, NULL);
+        if(ready < 0) {
+            if(errno == EINTR)
+                continue;
+            status = -1;
+            break;
+        }
+        if(fds[2].revents & POLLIN)
+            break;
+        if(ready == 0 && due_us >= 0) {
+            if(tx_batch_flush(batch)) {
+                status = -1;
+                break;
+            }
+            continue;
+        }
+        if(ready == 0)
+            break; // The peer has been quiet since the end of stdin
+
+        /** Device to stdout */
+
+        if(fds[1].revents & POLLIN) {
+            ssize_t n = -1;
+            if(splice_out) {
+                n = splice(device_descriptor, NULL, STDOUT_FILENO, NULL, TTY_PROFILE->read_chunk, SPLICE_F_MOVE);
+                if(n < 0 && errno == EINVAL)
+                    splice_out = 0;
+            }
+            if(!splice_out) {
+                n = read(device_descriptor, from_device, TTY_PROFILE->read_chunk);
+                trace_write(&TRACE, TRACE_RX, from_device, n);
+                if(n > 0 && write_all(STDOUT_FILENO, from_device, n))
+                    n = -1;
+            }
+            if(n < 0 && errno != EAGAIN && errno != EINTR) {
+                status = -1;
+                break;
+            }
+            stats_count_rx(n);
+            if(n > 0)
+                received += n;
+        }
+
+        if(fds[1].revents & POLLOUT)
+            device_full = 0;
+
+        /** Stdin to device */
+
+        if(fds[0].revents & (POLLIN | POLLHUP)) {
+            if(splice_in) {
+                ssize_t n = splice(STDIN_FILENO, NULL, device_descriptor, NULL, TTY_PROFILE->write_chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                stats_count_tx(n);
+                if(n > 0)
+                    sent += n;
+                else if(n == 0)
+                    stdin_open = 0;
+                else if(errno == EAGAIN)
+                    device_full = 1;
+                else if(errno == EINVAL)
+                    splice_in = 0;
+                else if(errno != EINTR) {
+                    status = -1;
+                    break;
+                }
+            }
+            if(!splice_in && batch->flush_delay_us) {
+                ssize_t n = read(STDIN_FILENO, to_device, TTY_PROFILE->write_chunk);
+                if(n > 0) {
+                    sent += n;
+                    if(tx_batch_send(batch, to_device, n, 0)) {
+                        status = -1;
+                        break;
+                    }
+                }
+                else if(n == 0 || errno != EINTR) {
+                    stdin_open = 0;
+                    if(tx_batch_flush(batch)) {
+                        status = -1;
+                        break;
+                    }
+                }
+            }
+            else if(!splice_in) {
+                pending = read(STDIN_FILENO, to_device, TTY_PROFILE->write_chunk);
+                pending_offset = 0;
+                if(pending <= 0) {
+                    stdin_open = 0;
+                    pending = 0;
+                }
+            }
+        }
+
+        if(pending > 0 && !device_full) {
+            uint64_t started = TRACE.header ? trace_clock_ns(CLOCK_MONOTONIC) : 0;
+            ssize_t n = write(device_descriptor, to_device + pending_offset, pending);
+            stats_count_tx(n);
+            trace_write_at(&TRACE, TRACE_TX, to_device + pending_offset, n, started);
+            if(n > 0) {
+                sent += n;
+                pending -= n;
+                pending_offset += n;
+            }
+            else if(n < 0 && errno == EAGAIN)
+                device_full = 1;
+            else if(n < 0 && errno != EINTR) {
+                status = -1;
+                break;
+            }
+        }
+    }
+
+    tx_batch_flush(batch);
+    fcntl(device_descriptor, F_SETFL, device_flags);
+
+    long long elapsed_ms = monotonic_ms() - start;
+    fprintf(stderr, "Raw pipe: %llu bytes sent, %llu bytes received in %lld ms%s%s\n", sent, received, elapsed_ms,
+        splice_in ? ", stdin spliced" : "", splice_out ? ", stdout spliced" : "");
+    tx_batch_report(batch, stderr);
+
+    free(to_device);
+    free(from_device);
+    return status;
+}
+
+/**
+ * Function: event_timer_arm
+ * ----------------------------
+ *  Arm the timerfd of the token loop.
+ *      @param[in] timer timerfd
+ *      @param[in] delay_us Expiry from now, 0 for right away and -1 to disarm it
+ */
+
+void event_timer_arm(int timer, long long delay_us) {
+
+    struct itimerspec expiry = { { 0, 0 }, { 0, 0 } };
+
+    if(delay_us == 0)
+        expiry.it_value.tv_nsec = 1; // A zero expiry disarms
+    else if(delay_us > 0) {
+        expiry.it_value.tv_sec = delay_us / 1000000;
+        expiry.it_value.tv_nsec = (delay_us % 1000000) * 1000;
+    }
+    timerfd_settime(timer, 0, &expiry, NULL);
+}
+
+/**
+ * Function: event_wait
+ * ----------------------------
+ *  Block until one of the sources of the token loop is ready, the expired timer and the received
+ *  counter are consumed.
+ *      @param[in,out] events Poll set indexed by EVENT_, a source with fd -1 is not waited for
+ * 
+ *      @return Bit per ready source (1 << EVENT_) or 0 if poll() failed
+ */
+
+int event_wait(struct pollfd* events) {
+
+    int ready = 0;
+
+    while(poll(events, EVENT_SOURCES, -1) < 0)
+        if(errno != EINTR)
+            return 0;
+
+    for(int i = 0; i < EVENT_SOURCES; i++)
+        if(events[i].fd >= 0 && events[i].revents)
+            ready |= 1 << i;
+
+    uint64_t value;
+    if((ready & (1 << EVENT_TIMER)) && read(events[EVENT_TIMER].fd, &value, sizeof(value)) != sizeof(value))
+        ready &= ~(1 << EVENT_TIMER); // Rearmed after poll() returned
+    if(ready & (1 << EVENT_RECEIVED))
+        eventfd_read(events[EVENT_RECEIVED].fd, &value);
+    return ready;
+}
+
+/**
+ * Function: send_token
+ * ----------------------------
+ *  Send a word of the user through the batch, with the <cr> of the module or as a data frame.
+ *      @param[in] batch Outbound batch of the device
+ *      @param[in] ring Receive ring, holds the capabilities of the peer
+ *      @param[in] token The word, with room for one more byte
+ *      @param[in] token_size Size of the word
+ *      @param[in] framed Send data frames
+ *      @param[in] compress Compress the frames once the peer inflates them
+ * 
+ *      @return 0 on success and -1 on error
+ */
+
+int send_token(struct tx_batch* batch, struct rx_ring* ring, char* token, int token_size, int framed, int compress) {
+
+    int escape = !strncmp(token, "$$$", 3);
+
+    /** Maybe put <cr><lf> at the end ot buffer, a frame carries its own end */
+
+    if(!framed && !escape)
+        token[token_size++] = 0xD;
+
+    /** The module has to see the escape sequence, it can not be part of a compressed block */
+
+    int peer_capabilities = atomic_load(&ring->peer_capabilities);
+
+    if(escape && batch->compress)
+        tx_batch_flush(batch);
+    batch->compress = compress && !escape && peer_capabilities > 0 && (peer_capabilities & FRAME_CAP_LZ);
+
+    if(framed && !escape) {
+        unsigned char frame[FRAME_HEADER_SIZE + TOKEN_SIZE + FRAME_CRC_SIZE];
+        int frame_size = frame_encode(frame, FRAME_TYPE_DATA, token, token_size);
+        return tx_batch_send(batch, (char*)frame, frame_size, 0);
+    }
+
+    /** The escape sequence has to reach the module on its own */
+
+    return tx_batch_send(batch, token, token_size, escape);
+}
+
+/**
+ * Function: token_loop
+ * ----------------------------
+ *  Send the words of stdin to the peer while the receive threads print what it sends. Everything
+ *  the loop waits for, stdin, the flush deadline of the batch, the bytes of the peer and the
+ *  shutdown, is one poll() in event_wait. At the end of stdin the loop waits until the peer has
+ *  been quiet for TOKEN_LINGER_STEP_MS, at most RAW_LINGER_MS.
+ *      @param[in] batch Outbound batch of the device
+ *      @param[in] ring Receive ring of the device
+ *      @param[in] framed Send data frames
+ *      @param[in] compress Negotiate the compression of the frames
+ *      @param[in] status_output Stream of the status messages
+ * 
+ *      @return 0 on success and -1 on error
+ */
+
+int token_loop(struct tx_batch* batch, struct rx_ring* ring, int framed, int compress, FILE* status_output) {
+
+    char input[4096];
+    char token[TOKEN_SIZE + 2];
+    int token_size = 0, ready;
+    eventfd_t received;
+
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if(timer < 0) {
+        printf("Error %d while creating the timer! (\"token_loop::timerfd_create\")\n", errno);
+        return -1;
+    }
+
+    struct pollfd events[EVENT_SOURCES] = {
+        { .fd = SHUTDOWN_EVENT, .events = POLLIN },
+        { .fd = -1, .events = POLLIN },
+        { .fd = timer, .events = POLLIN },
+        { .fd = ring->received, .events = POLLIN }
+    };
+
+    /** Ask the peer whether it inflates, a peer that starts later says so with its own HELLO */
+
+    if(compress) {
+        unsigned char hello[2] = { FRAME_CAP_LZ, 1 };
+        unsigned char frame[FRAME_HEADER_SIZE + sizeof(hello) + FRAME_CRC_SIZE];
+        int frame_size = frame_encode(frame, FRAME_TYPE_HELLO, hello, sizeof(hello));
+
+        tx_batch_send(batch, (char*)frame, frame_size, 1);
+        event_timer_arm(timer, HELLO_TIMEOUT_MS * 1000LL);
+        while(atomic_load(&ring->peer_capabilities) < 0) {
+            ready = event_wait(events);
+            if(!ready || (ready & (1 << EVENT_SHUTDOWN | 1 << EVENT_TIMER)))
+                break;
+        }
+
+        if(atomic_load(&ring->peer_capabilities) < 0)
+            fprintf(status_output, "The peer did not answer, sending uncompressed until it does\n");
+        else if(!(atomic_load(&ring->peer_capabilities) & FRAME_CAP_LZ))
+            fprintf(status_output, "The peer does not inflate, sending uncompressed\n");
+        else
+            fprintf(status_output, "Compression negotiated\n");
+        printf("> ");
+        fflush(stdout);
+    }
+
+    /** The words of the user, split at white space as scanf("%254s") did */
+
+    events[EVENT_STDIN].fd = STDIN_FILENO;
+    events[EVENT_RECEIVED].fd = -1;
+
+    while(keep_running) {
+
+        /** Nothing waits longer than the flush delay, not even while the user types */
+
+        event_timer_arm(timer, tx_batch_due_us(batch));
+
+        ready = event_wait(events);
+        if(!ready || (ready & (1 << EVENT_SHUTDOWN)))
+            break;
+
+        if((ready & (1 << EVENT_TIMER)) && tx_batch_due_us(batch) == 0)
+            tx_batch_flush(batch);
+
+        if(!(ready & (1 << EVENT_STDIN)))
+            continue;
+
+        ssize_t input_size = read(STDIN_FILENO, input, sizeof(input));
+        if(input_size < 0 && errno == EINTR)
+            continue;
+
+        if(input_size <= 0) {
+            if(token_size > 0 && send_token(batch, ring, token, token_size, framed, compress))
+                printf("Err > The message was not sent!");
+            break;
+        }
+
+        for(ssize_t i = 0; i < input_size; i++) {
+
+            int space = input[i] == ' ' || (input[i] >= '\t' && input[i] <= '\r');
+            if(!space)
+                token[token_size++] = input[i];
+
+            if((space && token_size > 0) || token_size == TOKEN_SIZE) {
+                token[token_size] = 0;
+                if(send_token(batch, ring, token, token_size, framed, compress))
+                    printf("Err > The message was not sent!");
+                token_size = 0;
+                printf("> ");
+                fflush(stdout);
+            }
+        }
+    }
+
+    tx_batch_flush(batch);
+
+    /** Without the fixed sleep after every message, give the peer time to answer the last ones */
+
+    tcdrain(batch->device_descriptor);
+    eventfd_read(ring->received, &received);
+
+    long long linger_end = monotonic_us() + RAW_LINGER_MS * 1000LL;
+
+    events[EVENT_STDIN].fd = -1;
+    events[EVENT_RECEIVED].fd = ring->received;
+
+    while(keep_running) {
+
+        long long remaining_us = linger_end - monotonic_us();
+        if(remaining_us <= 0)
+            break;
+        event_timer_arm(timer, remaining_us < TOKEN_LINGER_STEP_MS * 1000LL ? remaining_us : TOKEN_LINGER_STEP_MS * 1000LL);
+
+        ready = event_wait(events);
+        if(!ready || (ready & (1 << EVENT_SHUTDOWN)) || !(ready & (1 << EVENT_RECEIVED)))
+            break;
+    }
+
+    close(timer);
+    return 0;
+}
+
+/**
+ * Function: bench_fill
+ * ----------------------------
+ *  Write the payload of a benchmark message, the same sequence number always gives the same payload.
+ *      @param[out] payload Payload of settings->payload_size bytes
+ *      @param[in] sequence Sequence number of the message
+ *      @param[in] settings Benchmark settings
+ */
+
+void bench_fill(unsigned char* payload, uint32_t sequence, struct bench_settings* settings) {
+
+    uint32_t random = sequence * 2654435761u + 1;
+
+    memcpy(payload, &sequence, BENCH_HEADER_SIZE);
+
+    for(int i = BENCH_HEADER_SIZE; i < settings->payload_size; i++) {
+        switch(settings->pattern) {
+        case BENCH_COUNTER: payload[i] = sequence + i; break;
+        case BENCH_TEXT: payload[i] = 'a' + (sequence + i) % 26; break;
+        case BENCH_RANDOM:
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            payload[i] = random;
+            break;
+        }
+    }
+}
+
+/**
+ * Function: run_bench
+ * ----------------------------
+ *  Stream benchmark messages to the connected peer, at most a window of them on their way, and
+ *  check the echoes. The messages are framed and go through the outbound batch, the echoes are
+ *  decoded as thread_pooling_module decodes them. A message not echoed in BENCH_TIMEOUT_MS is lost.
+ *      @param[in] device_descriptor File descriptor of serial device, in data mode
+ *      @param[in] batch Outbound batch of the device
+ *      @param[in] settings Benchmark settings
+ * 
+ *      @return 0 on success and -1 on error
+ */
+
+int run_bench(int device_descriptor, struct tx_batch* batch, struct bench_settings* settings) {
+
+    int frame_size = FRAME_HEADER_SIZE + settings->payload_size + FRAME_CRC_SIZE;
+    int window = settings->window > 0 ? settings->window : 1;
+    if(window * frame_size > BENCH_MAX_IN_FLIGHT)
+        window = BENCH_MAX_IN_FLIGHT / frame_size > 0 ? BENCH_MAX_IN_FLIGHT / frame_size : 1;
+
+    long long* sent_us = calloc(settings->count, sizeof(long long));
+    unsigned char* echoed = calloc(settings->count, 1);
+    struct frame_decoder* decoder = calloc(1, sizeof(struct frame_decoder));
+    struct latency_histogram* rtt = calloc(1, sizeof(struct latency_histogram));
+    unsigned char payload[FRAME_MAX_PAYLOAD], expected[FRAME_MAX_PAYLOAD];
+    unsigned char frame[FRAME_MAX_SIZE];
+    unsigned char input[4096];
+    int next = 0, oldest = 0, in_flight = 0, status = 0;
+    unsigned long good = 0, bad_payloads = 0, duplicates = 0, lost = 0;
+
+    batch->flush_on_cr = 0;
+    tcflush(device_descriptor, TCIFLUSH);
+
+    printf("Bench: %d messages of %d bytes, %d on their way at once\n", settings->count, settings->payload_size, window);
+
+    long long start = monotonic_us();
+    long long last_echo = start;
+
+    while(keep_running && (next < settings->count || in_flight > 0)) {
+
+        /** Keep the window full */
+
+        while(next < settings->count && in_flight < window) {
+            bench_fill(payload, next, settings);
+            frame_encode(frame, FRAME_TYPE_DATA, payload, settings->payload_size);
+            sent_us[next++] = monotonic_us(); // The time in the batch counts in the round trip
+            in_flight++;
+            if(tx_batch_send(batch, (char*)frame, frame_size, 0)) {
+                status = -1;
+                break;
+            }
+        }
+        if(status)
+            break;
+
+        /** Wait for echoes, the batch deadline or the oldest message to time out */
+
+        long long now = monotonic_us();
+        long long wait_us = sent_us[oldest] + BENCH_TIMEOUT_MS * 1000LL - now;
+        long long due_us = tx_batch_due_us(batch);
+        if(due_us >= 0 && due_us < wait_us)
+            wait_us = due_us;
+        if(wait_us < 0)
+            wait_us = 0;
+
+        struct pollfd fds[2] = { { .fd = device_descriptor, .events = POLLIN }, { .fd = SHUTDOWN_EVENT, .events = POLLIN } };
+        int ready = poll(fds, 2, (wait_us + 999) / 1000);
+        if(ready < 0 && errno != EINTR) {
+            printf("Error %d while waiting for the echo! (\"run_bench::poll\")\n", errno);
+            status = -1;
+            break;
+        }
+        if(fds[1].revents & POLLIN)
+            break;
+        ready = ready > 0 && (fds[0].revents & POLLIN);
+
+        if(tx_batch_due_us(batch) == 0 && tx_batch_flush(batch)) {
+            status = -1;
+            break;
+        }
+
+        if(ready > 0) {
+
+            int recv_bytes = read(device_descriptor, input, sizeof(input));
+            const unsigned char* next_input = input;
+            struct frame echo;
+
+            now = monotonic_us();
+
+            stats_count_rx(recv_bytes);
+            trace_write(&TRACE, TRACE_RX, input, recv_bytes);
+            while(recv_bytes > 0 && link_frame_decode(decoder, &next_input, &recv_bytes, &echo)) {
+
+                uint32_t sequence;
+
+                if(echo.type != FRAME_TYPE_DATA || echo.size != settings->payload_size) {
+                    bad_payloads++;
+                    continue;
+                }
+                memcpy(&sequence, echo.payload, BENCH_HEADER_SIZE);
+                if(sequence >= (uint32_t)next || echoed[sequence]) {
+                    duplicates++;
+                    continue;
+                }
+
+                /** A message past its timeout was counted as lost already */
+
+                if(sequence >= (uint32_t)oldest)
+                    in_flight--;
+                else
+                    lost--;
+                echoed[sequence] = 1;
+                last_echo = now;
+
+                bench_fill(expected, sequence, settings);
+                if(memcmp(expected, echo.payload, settings->payload_size)) {
+                    bad_payloads++;
+                    continue;
+                }
+                good++;
+                histogram_add(rtt, now - sent_us[sequence]);
+            }
+        }
+
+        /** Move the oldest message on past the echoed and the timed out ones */
+
+        now = monotonic_us();
+        while(oldest < next && (echoed[oldest] || now - sent_us[oldest] > BENCH_TIMEOUT_MS * 1000LL)) {
+            if(!echoed[oldest]) {
+                lost++;
+                in_flight--;
+            }
+            oldest++;
+        }
+    }
+
+    tx_batch_flush(batch);
+
+    double elapsed = (last_echo - start) / 1e6;
+    if(elapsed <= 0)
+        elapsed = 1e-6;
+
+    printf("Bench: %d sent, %lu echoed intact, %lu lost, %lu corrupted (%lu bad CRC, %lu bad payloads), %lu duplicates in %.3f s\n",
+        next, good, lost, decoder->crc_errors + decoder->length_errors + bad_payloads, decoder->crc_errors + decoder->length_errors,
+        bad_payloads, duplicates, elapsed);
+    printf("Goodput: %.1f kB/s of payload, %.1f kB/s on the wire each way\n",
+        good * settings->payload_size / elapsed / 1000, next * frame_size / elapsed / 1000);
+    if(rtt->samples > 0)
+        printf("RTT: p50 %llu us, p90 %llu us, p99 %llu us, max %llu us\n", histogram_percentile(rtt, 50),
+            histogram_percentile(rtt, 90), histogram_percentile(rtt, 99), rtt->max);
+
+    free(sent_us);
+    free(echoed);
+    free(decoder);
+    free(rtt);
+    return status;
+}
+
+/**
+ * Function: file_send_frame
+ * ----------------------------
+ *  Frame an offset and the bytes after it and queue the frame on the outbound batch.
+ *      @param[in] batch Outbound batch of the device
+ *      @param[in] type Frame type
+ *      @param[in] offset Offset or size in front of the bytes
+ *      @param[in] data Bytes after the offset, may be NULL
+ *      @param[in] size Number of bytes
+ * 
+ *      @return 0 on success and -1 on error
+ */
+
+int file_send_frame(struct tx_batch* batch, unsigned char type, unsigned long long offset, const void* data, int size) {
+
+    unsigned char payload[FRAME_MAX_PAYLOAD];
+    unsigned char frame[FRAME_MAX_SIZE];
+
+    for(int i = 0; i < FILE_OFFSET_SIZE; i++)
+        payload[i] = offset >> (8 * i);
+    if(size > 0)
+        memcpy(payload + FILE_OFFSET_SIZE, data, size);
+
+    int frame_size = frame_encode(frame, type, payload, FILE_OFFSET_SIZE + size);
+    return tx_batch_send(batch, (char*)frame, frame_size, 0);
+}
+
+/**
+ * Function: file_frame_offset
+ * ----------------------------
+ *  Returns the offset in front of a file frame.
+ */
+
+unsigned long long file_frame_offset(struct frame* frame) {
+
+    unsigned long long offset = 0;
+
+    for(int i = 0; i < FILE_OFFSET_SIZE; i++)
+        offset |= (unsigned long long)frame->payload[i] << (8 * i);
+    return offset;
+}
+
+/**
+ * Function: file_progress
+ * ----------------------------
+ *  Print the progress of a transfer on the current line.
+ *      @param[in] done Bytes acknowledged or written
+ *      @param[in] size File size
+ *      @param[in] start_offset Offset the transfer resumed at
+ *      @param[in] start Start of the transfer, microseconds
+ *      @param[in] retransmits Chunks sent more than once or received out of order
+ */
+
+void file_progress(unsigned long long done, unsigned long long size, unsigned long long start_offset, long long start, unsigned long retransmits) {
+
+    double elapsed = (monotonic_us() - start) / 1e6;
+
+    printf("\r%5.1f%% %llu of %llu bytes, %.1f kB/s, %lu retransmits ", size ? 100.0 * done / size : 100.0, done, size,
+        elapsed > 0 ? (done - start_offset) / elapsed / 1000 : 0, retransmits);
+    fflush(stdout);
+}
+
+/**
+ * Function: send_file
+ * ----------------------------
+ *  Send a file to the peer. The file is mapped and its chunks sent up to FILE_WINDOW_BYTES ahead of
+ *  the acknowledged offset, so the link does not wait for every acknowledgement. Without progress
+ *  for FILE_RETRY_MS or after FILE_DUPLICATE_ACKS acknowledgements of the same offset, the chunks
+ *  are sent again from the acknowledged offset.
+ *      @param[in] device_descriptor File descriptor of serial device, in data mode
+ *      @param[in] batch Outbound batch of the device
+ *      @param[in] path File to send
+ * 
+ *      @return 0 once the peer has written the whole file and -1 otherwise
+ */
+
+int send_file(int device_descriptor, struct tx_batch* batch, char* path) {
+
+    struct stat file_stat;
+    unsigned char* data = NULL;
+
+    int file = open(path, O_RDONLY);
+    if(file < 0 || fstat(file, &file_stat)) {
+        printf("Error %d while opening %s: %s\n", errno, path, strerror(errno));
+        if(file >= 0)
+            close(file);
+        return -1;
+    }
+
+    unsigned long long size = file_stat.st_size;
+    if(size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+        if(data == MAP_FAILED) {
+            printf("Error %d while mapping %s! (\"send_file::mmap\")\n", errno, path);
+            close(file);
+            return -1;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    struct frame_decoder* decoder = calloc(1, sizeof(struct frame_decoder));
+    unsigned char input[4096];
+    char* name = basename(path);
+    long long acked = -1;               // Unknown until the offer is answered
+    unsigned long long next = 0, start_offset = 0;
+    unsigned long retransmits = 0;
+    int duplicate_acks = 0, status = 0;
+    long long start = monotonic_us(), last_progress = 0, last_ack = start, last_print = 0;
+
+    batch->flush_on_cr = 0;
+    tcflush(device_descriptor, TCIFLUSH);
+
+    while(keep_running && acked != (long long)size) {
+
+        long long now = monotonic_us();
+
+        if(now - last_ack > FILE_GIVE_UP_MS * 1000LL) {
+            printf("\nNo answer from the peer for %d s, run again to resume!\n", FILE_GIVE_UP_MS / 1000);
+            status = -1;
+            break;
+        }
+
+        /** Offer the file until the peer says where to start, then keep the window full */
+
+        if(acked < 0) {
+            if(now - last_progress > FILE_RETRY_MS * 1000LL) {
+                if(file_send_frame(batch, FRAME_TYPE_FILE_OFFER, size, name, strlen(name) < FILE_CHUNK_SIZE ? strlen(name) : FILE_CHUNK_SIZE) || tx_batch_flush(batch)) {
+                    status = -1;
+                    break;
+                }
+                last_progress = now;
+            }
+        }
+        else {
+            if(now - last_progress > FILE_RETRY_MS * 1000LL && next > (unsigned long long)acked) {
+                retransmits += (next - acked + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+                next = acked;
+                last_progress = now;
+            }
+
+            while(next < size && next - acked < FILE_WINDOW_BYTES) {
+                int chunk = size - next < FILE_CHUNK_SIZE ? size - next : FILE_CHUNK_SIZE;
+                if(file_send_frame(batch, FRAME_TYPE_FILE_DATA, next, data + next, chunk)) {
+                    status = -1;
+                    break;
+                }
+                next += chunk;
+            }
+            if(status)
+                break;
+        }
+
+        long long wait_us = FILE_RETRY_MS * 1000LL;
+        long long due_us = tx_batch_due_us(batch);
+        if(due_us >= 0 && due_us < wait_us)
+            wait_us = due_us;
+
+        struct pollfd fds[2] = { { .fd = device_descriptor, .events = POLLIN }, { .fd = SHUTDOWN_EVENT, .events = POLLIN } };
+        int ready = poll(fds, 2, (wait_us + 999) / 1000);
+        if(ready < 0 && errno != EINTR) {
+            printf("Error %d while waiting for the peer! (\"send_file::poll\")\n", errno);
+            status = -1;
+            break;
+        }
+        if(fds[1].revents & POLLIN)
+            break;
+        ready = ready > 0 && (fds[0].revents & POLLIN);
+
+        if(tx_batch_due_us(batch) == 0 && tx_batch_flush(batch)) {
+            status = -1;
+            break;
+        }
+
+        if(ready > 0) {
+
+            int recv_bytes = read(device_descriptor, input, sizeof(input));
+            const unsigned char* next_input = input;
+            struct frame ack;
+
+            stats_count_rx(recv_bytes);
+            trace_write(&TRACE, TRACE_RX, input, recv_bytes);
+            while(recv_bytes > 0 && link_frame_decode(decoder, &next_input, &recv_bytes, &ack)) {
+
+                if(ack.type != FRAME_TYPE_FILE_ACK || ack.size != FILE_OFFSET_SIZE)
+                    continue;
+
+                unsigned long long offset = file_frame_offset(&ack);
+                if(offset > size)
+                    continue;
+
+                now = monotonic_us();
+                last_ack = now;
+
+                if(acked < 0) {
+                    acked = offset;
+                    next = offset;
+                    start_offset = offset;
+                    last_progress = now;
+                    if(offset > 0)
+                        printf("Resuming %s at %llu of %llu bytes\n", name, offset, size);
+                }
+                else if((long long)offset > acked) {
+                    acked = offset;
+                    duplicate_acks = 0;
+                    last_progress = now;
+                    if(next < offset)
+                        next = offset;
+                }
+                else if((long long)offset == acked && next > offset && ++duplicate_acks == FILE_DUPLICATE_ACKS) {
+
+                    /** The peer keeps asking for the same offset, a chunk got lost */
+
+                    retransmits += (next - offset + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+                    next = offset;
+                    duplicate_acks = 0;
+                    last_progress = now;
+                }
+            }
+        }
+
+        if(acked >= 0 && monotonic_us() - last_print > FILE_PROGRESS_MS * 1000LL) {
+            file_progress(acked, size, start_offset, start, retransmits);
+            last_print = monotonic_us();
+        }
+    }
+
+    tx_batch_flush(batch);
+    if(status == 0 && acked == (long long)size) {
+        file_progress(acked, size, start_offset, start, retransmits);
+        printf("\nSent %s, %llu bytes in %.3f s\n", name, size - start_offset, (monotonic_us() - start) / 1e6);
+    }
+    else
+        status = -1;
+
+    if(data)
+        munmap(data, size);
+    close(file);
+    free(decoder);
+    return status;
+}
+
+/**
+ * Function: file_resume_save
+ * ----------------------------
+ *  Record how far the transfer has come in the sidecar of the partial file.
+ *      @param[in] part File descriptor of the sidecar
+ *      @param[in] resume State of the transfer
+ *
+ *      @return 0 on success and -1 on error
+ */
+
+int file_resume_save(int part, struct file_resume* resume) {
+
+    ssize_t size = offsetof(struct file_resume, name) + resume->name_size;
+    return pwrite(part, resume, size, 0) == size ? 0 : -1;
+}
+
+/**
+ * Function: file_resume_offset
+ * ----------------------------
+ *  Where an offer continues the partial file. The sidecar has to name the same file of the same
+ *  size, and the bytes the sidecar counts as written have to be in the file unchanged.
+ *      @param[in] file File descriptor of the partial file, readable
+ *      @param[in] part_path Sidecar of the partial file
+ *      @param[in,out] resume Name and size of the offer, the offset and the CRC are set
+ *
+ *      @return Offset to continue at, 0 to start over
+ */
+
+unsigned long long file_resume_offset(int file, const char* part_path, struct file_resume* resume) {
+
+    struct file_resume saved;
+    unsigned char buffer[4096];
+
+    resume->offset = 0;
+    resume->crc = 0;
+
+    int part = open(part_path, O_RDONLY);
+    if(part < 0)
+        return 0;
+    ssize_t size = read(part, &saved, sizeof(saved));
+    close(part);
+
+    if(size < (ssize_t)offsetof(struct file_resume, name) || memcmp(saved.magic, FILE_RESUME_MAGIC, 8)
+        || saved.size != resume->size || saved.offset > saved.size || saved.name_size != resume->name_size
+        || size != (ssize_t)(offsetof(struct file_resume, name) + saved.name_size) || memcmp(saved.name, resume->name, saved.name_size))
+        return 0;
+
+    uint32_t crc = 0;
+    for(unsigned long long offset = 0; offset < saved.offset; ) {
+        size = pread(file, buffer, saved.offset - offset < sizeof(buffer) ? saved.offset - offset : sizeof(buffer), offset);
+        if(size <= 0)
+            return 0;
+        crc = frame_crc32(crc, buffer, size);
+        offset += size;
+    }
+    if(crc != saved.crc)
+        return 0;
+
+    resume->offset = saved.offset;
+    resume->crc = crc;
+    return resume->offset;
+}
+
+/**
+ * Function: recv_file
+ * ----------------------------
+ *  Receive a file from the peer. The chunks are written in order only and the sidecar records the
+ *  offset and the CRC written so far, a later offer of the same file starts there. Every batch of
+ *  frames read is acknowledged with the offset written so far.
+ *      @param[in] device_descriptor File descriptor of serial device, in data mode
+ *      @param[in] batch Outbound batch of the device
+ *      @param[in] path File to write
+ * 
+ *      @return 0 once the whole file has been written and -1 otherwise
+ */
+
+int recv_file(int device_descriptor, struct tx_batch* batch, char* path) {
+
+    char part_path[PATH_MAX];
+    struct file_resume resume = { FILE_RESUME_MAGIC };
+    int part = -1;
+
+    if(snprintf(part_path, sizeof(part_path), "%s" FILE_RESUME_SUFFIX, path) >= (int)sizeof(part_path)) {
+        printf("Error %d while opening %s: %s\n", ENAMETOOLONG, path, strerror(ENAMETOOLONG));
+        return -1;
+    }
+
+    int file = open(path, O_RDWR | O_CREAT, 0644);
+    if(file < 0) {
+        printf("Error %d while opening %s: %s\n", errno, path, strerror(errno));
+        return -1;
+    }
+
+    struct frame_decoder* decoder = calloc(1, sizeof(struct frame_decoder));
+    unsigned char input[4096];
+    long long size = -1;                // Unknown until the offer
+    unsigned long long written = 0, start_offset = 0;
+    unsigned long out_of_order = 0;
+    int status = 0;
+    long long start = monotonic_us(), last_frame = start, last_print = 0, done_at = 0;
+
+    batch->flush_on_cr = 0;
+    tcflush(device_descriptor, TCIFLUSH);
+    printf("Waiting for the peer to send a file...\n");
+    fflush(stdout);
+
+    while(keep_running) {
+
+        long long now = monotonic_us();
+
+        if(done_at && now - done_at > FILE_LINGER_MS * 1000LL)
+            break;
+        if(size >= 0 && !done_at && now - last_frame > FILE_GIVE_UP_MS * 1000LL) {
+            printf("\nNo data from the peer for %d s, run again to resume!\n", FILE_GIVE_UP_MS / 1000);
+            status = -1;
+            break;
+        }
+
+        struct pollfd fds[2] = { { .fd = device_descriptor, .events = POLLIN }, { .fd = SHUTDOWN_EVENT, .events = POLLIN } };
+        int ready = poll(fds, 2, FILE_PROGRESS_MS);
+        if(ready < 0 && errno != EINTR) {
+            printf("Error %d while waiting for the peer! (\"recv_file::poll\")\n", errno);
+            status = -1;
+            break;
+        }
+        if(fds[1].revents & POLLIN)
+            break;
+        ready = ready > 0 && (fds[0].revents & POLLIN);
+
+        if(ready > 0) {
+
+            int recv_bytes = read(device_descriptor, input, sizeof(input));
+            const unsigned char* next_input = input;
+            struct frame frame;
+            int ack_pending = 0;
+
+            stats_count_rx(recv_bytes);
+            trace_write(&TRACE, TRACE_RX, input, recv_bytes);
+            while(recv_bytes > 0 && link_frame_decode(decoder, &next_input, &recv_bytes, &frame)) {
+
+                if(frame.size < FILE_OFFSET_SIZE)
+                    continue;
+
+                unsigned long long offset = file_frame_offset(&frame);
+                last_frame = monotonic_us();
+
+                if(frame.type == FRAME_TYPE_FILE_OFFER) {
+
+                    /** Anything the sidecar does not vouch for belongs to another transfer */
+
+                    if(size < 0) {
+                        resume.size = offset;
+                        resume.name_size = frame.size - FILE_OFFSET_SIZE;
+                        memcpy(resume.name, frame.payload + FILE_OFFSET_SIZE, resume.name_size);
+                        written = file_resume_offset(file, part_path, &resume);
+                        if(ftruncate(file, written))
+                            printf("Error %d while truncating %s! (\"recv_file::ftruncate\")\n", errno, path);
+                        part = open(part_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                        if(part < 0 || file_resume_save(part, &resume))
+                            printf("Error %d while writing %s, the transfer can not be resumed! (\"recv_file::file_resume_save\")\n", errno, part_path);
+                        start_offset = written;
+                        start = last_frame;
+                        size = offset;
+                        printf("Receiving %.*s, %lld bytes", frame.size - FILE_OFFSET_SIZE, frame.payload + FILE_OFFSET_SIZE, size);
+                        if(written > 0)
+                            printf(", resuming at %llu", written);
+                        printf("\n");
+                    }
+                    ack_pending = 1;
+                }
+                else if(frame.type == FRAME_TYPE_FILE_DATA && size >= 0) {
+
+                    int chunk = frame.size - FILE_OFFSET_SIZE;
+
+                    if(offset == written && written + chunk <= (unsigned long long)size) {
+                        if(pwrite(file, frame.payload + FILE_OFFSET_SIZE, chunk, offset) != chunk) {
+                            printf("Error %d while writing %s! (\"recv_file::pwrite\")\n", errno, path);
+                            status = -1;
+                            break;
+                        }
+                        resume.crc = frame_crc32(resume.crc, frame.payload + FILE_OFFSET_SIZE, chunk);
+                        written += chunk;
+                    }
+                    else if(offset != written)
+                        out_of_order++;
+                    ack_pending = 1;
+                }
+            }
+            if(status)
+                break;
+
+            /** One acknowledgement for everything read at once */
+
+            if(ack_pending && (file_send_frame(batch, FRAME_TYPE_FILE_ACK, written, NULL, 0) || tx_batch_flush(batch))) {
+                status = -1;
+                break;
+            }
+        }
+
+        if(size >= 0 && written == (unsigned long long)size && !done_at)
+            done_at = monotonic_us();
+
+        if(size >= 0 && monotonic_us() - last_print > FILE_PROGRESS_MS * 1000LL) {
+            file_progress(written, size, start_offset, start, out_of_order);
+            last_print = monotonic_us();
+            resume.offset = written;
+            if(part >= 0)
+                file_resume_save(part, &resume);
+        }
+    }
+
+    if(size >= 0 && written == (unsigned long long)size) {
+        file_progress(written, size, start_offset, start, out_of_order);
+        printf("\nReceived %s, %llu bytes\n", path, written - start_offset);
+        unlink(part_path);
+    }
+    else {
+        resume.offset = written;
+        if(part >= 0)
+            file_resume_save(part, &resume);
+        status = -1;
+    }
+
+    if(part >= 0)
+        close(part);
+    close(file);
+    free(decoder);
+    return status;
 }
 
 /**
- * Function: disconnect_from_ble
+ * Function: daemon_reply
  * ----------------------------
- *  Tell the module to diconnect from the connected Bluetooth device.
- *      @param[in] device_descriptor File descriptor of serial device
- * 
- *      @return 0 If Success
- *      @return 1 If Error
- * 
- *      @example K,<cr> -> should echo KILL<cl><lf>
+ *  Send a reply line to a daemon client, a client that can not take it is dropped.
+ *      @param[in] client Daemon client
+ *      @param[in] format printf like format of the reply, the \n is added
  */
 
-int disconnect_from_ble(int device_descriptor) {
+void daemon_reply(struct daemon_client* client, const char* format, ...) {
 
-    char cmd_buffer[] = {'K', ',', 0x0D};
-    char* recv_buffer = malloc(sizeof(char) * 256);
+    char reply[320];
+    va_list args;
 
-    get_response_from_device(device_descriptor, cmd_buffer, 3, recv_buffer);
-    if(!strncmp(recv_buffer, "KILL", 4)) {
-        free(recv_buffer);
-        return 0;
+    va_start(args, format);
+    int reply_size = vsnprintf(reply, sizeof(reply) - 1, format, args);
+    va_end(args);
+
+    if(reply_size > (int)sizeof(reply) - 2)
+        reply_size = sizeof(reply) - 2;
+    reply[reply_size++] = '\n';
+
+    if(send(client->fd, reply, reply_size, MSG_NOSIGNAL | MSG_DONTWAIT) != reply_size) {
+        close(client->fd);
+        client->fd = -1;
     }
-    free(recv_buffer);
-    return 1;
 }
 
-
 /**
- * Function: check_device_connected
+ * Function: daemon_publish
  * ----------------------------
- *  Check if the device is connected.
- *      @param[in] device_descriptor File descriptor of serial device
- * 
- *      @return 0 If is connected
- *      @return 1 If is not connected
- * 
- *      @example GK<cr> -> should echo 1,0,0 if connected
+ *  Send the bytes received from the device to every subscribed client as DATA <size>\n<bytes>.
+ *  Subscribers that do not keep up are dropped instead of stalling the device.
+ *      @param[in] clients Daemon clients
+ *      @param[in] data Bytes received from the device
+ *      @param[in] data_size Number of bytes received
  */
 
-int check_device_connected(int device_descriptor) {
+void daemon_publish(struct daemon_client* clients, char* data, int data_size) {
 
-    char cmd_buffer[] = {'G', 'K', 0x0D};
-    char* recv_buffer = malloc(sizeof(char) * 256);
+    char header[32];
+    int header_size = snprintf(header, sizeof(header), "DATA %d\n", data_size);
+    struct iovec message[2] = { { header, header_size }, { data, data_size } };
+    struct msghdr packet = { .msg_iov = message, .msg_iovlen = 2 };
 
-    get_response_from_device(device_descriptor, cmd_buffer, 3, recv_buffer);
-    if(!strncmp(recv_buffer, "1,0,0", 5)) {
-        free(recv_buffer);
-        return 0;
+    for(int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+        if(clients[i].fd < 0 || !clients[i].subscribed)
+            continue;
+        if(sendmsg(clients[i].fd, &packet, MSG_NOSIGNAL | MSG_DONTWAIT) != header_size + data_size) {
+            close(clients[i].fd);
+            clients[i].fd = -1;
+        }
     }
-    free(recv_buffer);
-    return 1;
 }
 
 /**
- * Function: check_device_connected
+ * Function: daemon_drain
  * ----------------------------
- *  Check if the device is connected.
- *      @param[in] device_descriptor File descriptor of serial device
- *      @param[in] recv_buffer Buffer to store the address, should be allocated before call buffer[256]
- * 
- *      @return te address of the connected device
- * 
- *      @example GR<cr> -> should echo the connected device address
+ *  Drain of the daemon session, the bytes received before a CMD mode request go to the
+ *  subscribers as any other data.
+ *      @param[in] context Clients of the daemon
  */
 
-int get_connected_address(int device_descriptor, char* recv_buffer) {
+void daemon_drain(void* context, char* data, int data_size) {
+    daemon_publish(context, data, data_size);
+}
 
-    char cmd_buffer[] = {'G', 'R', 0x0D};
+/**
+ * Function: daemon_handle_request
+ * ----------------------------
+ *  Execute a request line of a client. The CMD mode requests pipeline the exit of the
+ *  CMD mode so the device is back in data mode for the subscribers when they return.
+ *      @param[in] session Command session of the device
+ *      @param[in] client Client that sent the request
+ *      @param[in] line Request line without the \n
+ * 
+ *      @example status -> OK connected 0006664AB123 | OK idle
+ *      @example connect [11:22:33:44:55:66] -> OK | ERR <device response>
+ *      @example send hello -> OK 6
+ */
 
-    int recv_size = get_response_from_device(device_descriptor, cmd_buffer, 3, recv_buffer);
-    recv_buffer[recv_size] = 0;
+void daemon_handle_request(struct cmd_session* session, struct daemon_client* client, char* line) {
 
-    return recv_size;
-}
+    if(!strcmp(line, "status")) {
+        if(session_open(session)) {
+            daemon_reply(client, "ERR no CMD mode");
+            return;
+        }
+        struct cmd_request* connected_request = check_device_connected(session);
+        struct cmd_request* address_request = get_connected_address(session);
+        queue_exit_device_cmd_mode(session);
+        if(session_flush(session))
+            daemon_reply(client, "ERR no response");
+        else if(!strncmp(connected_request->response, "1,0,0", 5))
+            daemon_reply(client, "OK connected %s", address_request->response);
+        else
+            daemon_reply(client, "OK idle");
+    }
+    else if(!strncmp(line, "connect ", 8)) {
+        char formatted_mac[13];
+        if(!parse_target_address(line + 8, formatted_mac)) {
+            daemon_reply(client, "ERR invalid address, use [11:22:33:44:55:66]");
+            return;
+        }
+        if(session_open(session)) {
+            daemon_reply(client, "ERR no CMD mode");
+            return;
+        }
+        struct cmd_request* connect_request = connect_to_ble_address(session, formatted_mac);
+        queue_exit_device_cmd_mode(session);
+        session_flush(session);
+        if(!strncmp(connect_request->response, "AOK", 3))
+            daemon_reply(client, "OK");
+        else
+            daemon_reply(client, "ERR %s", connect_request->response);
+    }
+    else if(!strcmp(line, "disconnect")) {
+        if(session_open(session)) {
+            daemon_reply(client, "ERR no CMD mode");
+            return;
+        }
+        struct cmd_request* disconnect_request = disconnect_from_ble(session);
+        queue_exit_device_cmd_mode(session);
+        session_flush(session);
+        if(!strncmp(disconnect_request->response, "KILL", 4))
+            daemon_reply(client, "OK");
+        else
+            daemon_reply(client, "ERR %s", disconnect_request->response);
+    }
+    else if(!strncmp(line, "send ", 5)) {
 
+        /** A "---" that got no END leaves the module in CMD mode, the text would run as a command */
 
+        if(session->in_cmd_mode && session_close(session)) {
+            daemon_reply(client, "ERR still in CMD mode");
+            return;
+        }
+        int message_size = strlen(line + 5);
+        line[5 + message_size++] = 0x0D;
+        int sent_bytes = send_message_to_device(session->device_descriptor, line + 5, message_size);
+        if(sent_bytes == message_size)
+            daemon_reply(client, "OK %d", sent_bytes);
+        else
+            daemon_reply(client, "ERR only %d bytes were sent", sent_bytes);
+    }
+    else if(!strcmp(line, "subscribe")) {
+        client->subscribed = 1;
+        daemon_reply(client, "OK");
+    }
+    else
+        daemon_reply(client, "ERR unknown request, use status, connect, disconnect, send or subscribe");
+}
 
 /**
- * Function: thread_pooling_module
+ * Function: run_daemon
  * ----------------------------
- *  Thread function in pooling mode, read from the device descriptor every 0.1 seconds
- *  Thread function is cancellable and ASYNC cancellable
- *      @param[in] args device descriptor
+ *  Serve the clients of the Unix socket until SIGINT. A single poll() waits on the socket,
+ *  the clients and the device, so the device stays open and configured between requests.
+ *      @param[in] session Command session of the opened device
+ *      @param[in] socket_path Path of the Unix socket
  * 
+ *      @return 0 on SIGINT, 1 if the socket could not be created
  */
 
-void* thread_pooling_module(void* args) {
+int run_daemon(struct cmd_session* session, char* socket_path) {
 
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct daemon_client clients[DAEMON_MAX_CLIENTS];
+    struct pollfd fds[3 + DAEMON_MAX_CLIENTS];   // The socket, the device, the clients and SHUTDOWN_EVENT
+    char data_buffer[256];
 
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS,NULL);
+    if(strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Error: socket path %s is too long!\n", socket_path);
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if(listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) || listen(listen_fd, 8)) {
+        printf("Error %d while creating %s: %s\n", errno, socket_path, strerror(errno));
+        if(listen_fd >= 0)
+            close(listen_fd);
+        return 1;
+    }
 
-    int device_descriptor = *(int*)args;
-    char* pmod_buffer = calloc(256, sizeof(char));
+    for(int i = 0; i < DAEMON_MAX_CLIENTS; i++)
+        clients[i].fd = -1;
 
-    int oled_file = open("/dev/zed_oled", O_RDWR | O_NOCTTY | O_SYNC);
-    int rounded_recv_bytes = 0;
-    char buffer[512];
-    int count = 0;
+    session->drain = daemon_drain;
+    session->drain_context = clients;
 
+    while(keep_running) {
 
-    while(1) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = session->device_descriptor;
+        fds[1].events = POLLIN;
+        for(int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+            fds[2 + i].fd = clients[i].fd;
+            fds[2 + i].events = POLLIN;
+        }
+        fds[2 + DAEMON_MAX_CLIENTS].fd = SHUTDOWN_EVENT;
+        fds[2 + DAEMON_MAX_CLIENTS].events = POLLIN;
 
-        //Sleep 
-        count = 0;
-        usleep(100000);
-        int recv_bytes = read(device_descriptor, pmod_buffer, 256);  // Read up to 256 characters if ready to read 
+        if(poll(fds, 3 + DAEMON_MAX_CLIENTS, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            printf("Error %d while waiting for requests! (\"run_daemon::poll\")\n", errno);
+            break;
+        }
+        if(fds[2 + DAEMON_MAX_CLIENTS].revents & POLLIN)
+            break;
 
+        if(fds[0].revents & POLLIN) {
+            int client_fd = accept(listen_fd, NULL, NULL);
+            int slot = 0;
+            while(slot < DAEMON_MAX_CLIENTS && clients[slot].fd >= 0)
+                slot++;
+            if(slot == DAEMON_MAX_CLIENTS)
+                close(client_fd);
+            else if(client_fd >= 0) {
+                memset(&clients[slot], 0, sizeof(clients[slot]));
+                clients[slot].fd = client_fd;
+            }
+        }
 
+        if(fds[1].revents & POLLIN) {
+            int recv_bytes = read(session->device_descriptor, data_buffer, sizeof(data_buffer));
+            stats_count_rx(recv_bytes);
+            trace_write(&TRACE, TRACE_RX, data_buffer, recv_bytes);
+            if(recv_bytes > 0)
+                daemon_publish(clients, data_buffer, recv_bytes);
+        }
 
-        if(recv_bytes > 0) {
+        for(int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
 
-            pmod_buffer[recv_bytes] = 0;
-            printf("\nPmodBT2 Responded > %s", pmod_buffer);
+            struct daemon_client* client = &clients[i];
 
+            if(client->fd < 0 || fds[2 + i].fd != client->fd || !(fds[2 + i].revents & (POLLIN | POLLHUP)))
+                continue;
 
-            if(recv_bytes%16 != 0) {
-                rounded_recv_bytes = ((recv_bytes/16) + 1) * 16;
-                for(int i = recv_bytes; i< rounded_recv_bytes; i++) {
-                    pmod_buffer[i] = 0x20;
-                }
-                recv_bytes = rounded_recv_bytes;
+            int recv_bytes = recv(client->fd, client->line + client->line_size, sizeof(client->line) - 1 - client->line_size, 0);
+            if(recv_bytes <= 0) {
+                close(client->fd);
+                client->fd = -1;
+                continue;
             }
+            client->line_size += recv_bytes;
 
+            /** Execute every complete request line, keep the partial one */
 
-            for(int i = 15; i <= recv_bytes; i+=16) {
-                for(int j = i; j > i - 16; j--) {
-                    memcpy(buffer + (count*8), oledAsciiMatrix[pmod_buffer[j]], 8);
-                    count++;
-                }
+            char* newline;
+            while(client->fd >= 0 && (newline = memchr(client->line, '\n', client->line_size))) {
+                int request_size = newline - client->line + 1;
+                *newline = 0;
+                daemon_handle_request(session, client, client->line);
+                client->line_size -= request_size;
+                memmove(client->line, client->line + request_size, client->line_size);
             }
 
-            for(int i = count*8; i< 512; i++)
-                buffer[i] = 0;
-
-            write(oled_file, buffer, 512);
-
+            if(client->fd >= 0 && client->line_size == sizeof(client->line) - 1) {
+                daemon_reply(client, "ERR request too long");
+                client->line_size = 0;
+            }
         }
     }
-    close(oled_file);
 
+    for(int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+        if(clients[i].fd >= 0)
+            close(clients[i].fd);
+    }
+    session->drain = NULL;
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
 }
 
 /**
- * Function: handler
+ * Function: control_daemon
  * ----------------------------
- *  Dummy handler function for SIGALRM to stop the scanf function
+ *  Send one request to the running daemon and print its reply. A subscribe request keeps
+ *  printing the received data until SIGINT.
+ *      @param[in] socket_path Path of the Unix socket
+ *      @param[in] request Request line without the \n
  * 
+ *      @return 0 if the daemon replied OK and -1 otherwise
+ */
+
+int control_daemon(char* socket_path, char* request) {
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    char reply[512];
+
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    int daemon_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(daemon_fd < 0 || connect(daemon_fd, (struct sockaddr*)&address, sizeof(address))) {
+        printf("Error %d while connecting to %s: %s\n", errno, socket_path, strerror(errno));
+        if(daemon_fd >= 0)
+            close(daemon_fd);
+        return -1;
+    }
+
+    int request_size = strlen(request);
+    if(send(daemon_fd, request, request_size, MSG_NOSIGNAL) != request_size || send(daemon_fd, "\n", 1, MSG_NOSIGNAL) != 1) {
+        printf("Error %d while sending the request to %s\n", errno, socket_path);
+        close(daemon_fd);
+        return -1;
+    }
+
+    int subscribe = !strcmp(request, "subscribe");
+    int status = -1;
+    int recv_bytes;
+    struct pollfd fds[2] = { { .fd = daemon_fd, .events = POLLIN }, { .fd = SHUTDOWN_EVENT, .events = POLLIN } };
+
+    while(keep_running) {
+
+        if(poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+        if((fds[1].revents & POLLIN) || !(fds[0].revents & (POLLIN | POLLHUP)))
+            continue;
+        if((recv_bytes = recv(daemon_fd, reply, sizeof(reply), 0)) <= 0)
+            break;
+
+        fwrite(reply, 1, recv_bytes, stdout);
+        fflush(stdout);
+        if(status < 0)
+            status = strncmp(reply, "OK", 2) ? -1 : 0;
+        if(!subscribe && memchr(reply, '\n', recv_bytes))
+            break;
+    }
+
+    close(daemon_fd);
+    return status;
+}
+
+/**
+ * Function: fleet_report
+ * ----------------------------
+ *  Print the result of a fleet operation on a device, with several devices the line starts with
+ *  the device and ends with the time its pipeline took.
+ *      @param[in] device Device after fleet_run
+ *      @param[in] format printf like format of the result
+ */
+
+void fleet_report(struct pmod_device* device, const char* format, ...) {
+
+    va_list args;
+
+    if(DEVICE_COUNT > 1)
+        printf("%s: ", device->name);
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+
+    if(DEVICE_COUNT > 1 && device->fleet_done_us)
+        printf(" (%.1f ms)", (device->fleet_done_us - device->fleet_started_us) / 1e3);
+    printf("\n");
+}
+
+/**
+ * Function: close_devices
+ * ----------------------------
+ *  Leave every open device as the next run expects it and close it.
  */
 
-void handler(int signo) {
-  return;
+void close_devices(void) {
+
+    for(int i = 0; i < DEVICE_COUNT; i++) {
+        do_cleanup(&DEVICES[i]);
+        close(DEVICES[i].descriptor);
+    }
+    DEVICE_COUNT = 0;
 }
 
 int main(int argc, char* argv[]) {
@@ -562,43 +4804,79 @@ int main(int argc, char* argv[]) {
 
     arguments.mode = UNSET;
     arguments.ble_address = NULL;
+    arguments.device_count = 0;
+    arguments.raw = 0;
+    arguments.flush_size = -1; // Taken from the profile
+    arguments.flush_delay_us = 0;
+    arguments.baud = MODULE_DEFAULT_BAUD;
+    arguments.flow = 0;
+    arguments.profile = find_tty_profile(TTY_DEFAULT_PROFILE);
+    arguments.framed = 0;
+    arguments.compress = 0;
+    arguments.stats_path = NULL;
+    arguments.trace_path = NULL;
+    arguments.bench.payload_size = 64;
+    arguments.bench.count = 1000;
+    arguments.bench.window = 8;
+    arguments.bench.pattern = BENCH_COUNTER;
+    arguments.socket_path = DAEMON_SOCKET_PATH;
+    arguments.oled_name = OLED_DEVICE;
+    arguments.oled_fps = OLED_DEFAULT_FPS;
+    arguments.request = NULL;
+    arguments.rt = RT;
+    arguments.jitter_seconds = 0;
+    arguments.inquiry_seconds = INQUIRY_DEFAULT_SECONDS;
+    arguments.inquiry_rssi = 0;
+    arguments.peer_cache_path = PEER_CACHE_PATH;
+    arguments.peer_ttl = PEER_CACHE_TTL;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
-    signal(SIGINT, interrupt_handler);
+    /** Before any device is opened, --baud alone would leave the module at another speed */
 
-    /** Initialize device */
+    if(arguments.mode == UNSET) {
+        printf("See --help for more information!\n");
+        return -1;
+    }
 
-    #ifdef RELEASE
+    if(arguments.device_count == 0)
+        arguments.device_names[arguments.device_count++] = "/dev/ttyPS1";
 
-        char * device_name = "/dev/ttyPS1";
-        int device_descriptor = open(device_name, O_RDWR | O_NOCTTY | O_SYNC);
+    if(arguments.framed && arguments.raw) {
+        printf("--framed and --raw can not be used together, raw mode moves the bytes unchanged!\n");
+        return -1;
+    }
 
-        if (device_descriptor < 0) {
-            printf("Error %d  while opening %s: %s\n", errno, device_name, strerror(errno));
-            return -1;
-        }
+    /** The data modes and the attack own the line of a single module, the trace has no device column */
 
-        initialize_serial(device_descriptor, B115200, 0); // set speed to 115,200 bps, 8n1 (no parity)
-        set_blocking(device_descriptor);                   
+    int fleet_mode = arguments.mode == STATUS || arguments.mode == CONNECT || arguments.mode == DISCONNECT
+        || arguments.mode == EXITCMDMODE || arguments.mode == REBOOT;
 
-        //char* recv_buffer = malloc(sizeof(char) * 256);
+    if(arguments.device_count > 1 && (!fleet_mode || arguments.trace_path)) {
+        printf("Only --status, --connect, --disconnect, --restart and --exitCMDmode take several devices, without --trace-file!\n");
+        return -1;
+    }
 
-    #endif
+    /** Before any other thread, they all inherit the blocked signals */
 
+    start_signal_thread(arguments.stats_path);
 
-    if(arguments.mode == UNSET) {
-        printf("See --help for more information!\n");
-        return -1;
-    }
+    /** Requests for the daemon do not touch the device */
 
-    /** Connect to a given Ble Device address */
+    if(arguments.mode == CONTROL)
+        return control_daemon(arguments.socket_path, arguments.request);
 
-    if(arguments.mode == CONNECT && arguments.ble_address) {
+    if(arguments.mode == PEERS)
+        return print_peers(arguments.peer_cache_path, arguments.peer_ttl);
 
-        int valid_mac_address = is_valid_mac_address(arguments.ble_address, arguments.formatted_mac);
+    /** A name or prefix is looked up in the peer cache, no scan before the connect and no device touched for a bad one */
 
-        arguments.ble_address++;
+    char peer_label[64];
+
+    if(arguments.mode == CONNECT && arguments.ble_address) {
+
+        int valid_mac_address = resolve_peer(arguments.ble_address, arguments.formatted_mac, peer_label, sizeof(peer_label),
+            arguments.peer_cache_path, arguments.peer_ttl);
 
         #ifdef DEBUG
 
@@ -609,19 +4887,113 @@ int main(int argc, char* argv[]) {
 
         #endif
 
-        #ifdef RELEASE
+        if(!valid_mac_address)
+            return -1;
+    }
 
-            printf("Entering comand mode...\n");
-            if(!enter_device_cmd_mode(device_descriptor)) {
+    RT = arguments.rt;
+    if(RT.lock_memory)
+        rt_lock_memory();
+
+    if(arguments.mode == JITTER)
+        return run_jitter(arguments.jitter_seconds);
+
+    if(arguments.trace_path) {
+        if(trace_open(&TRACE, arguments.trace_path, TRACE_DEFAULT_RECORDS, 1)) {
+            printf("Error %d while opening the trace %s! (\"main::trace_open\")\n", errno, arguments.trace_path);
+            return -1;
+        }
+        trace_note("pmodbt %d on %s", getpid(), arguments.device_names[0]);
+    }
+
+    /** Initialize device */
+
+    #ifdef RELEASE
+
+        for(int i = 0; i < arguments.device_count; i++) {
+
+            struct pmod_device* device = &DEVICES[i];
+
+            device->name = arguments.device_names[i];
+            device->baud = MODULE_DEFAULT_BAUD;
+            device->descriptor = open(device->name, O_RDWR | O_NOCTTY | O_SYNC);
+
+            if (device->descriptor < 0) {
+                printf("Error %d  while opening %s: %s\n", errno, device->name, strerror(errno));
+                close_devices();
+                return -1;
+            }
+            DEVICE_COUNT = i + 1;
+
+            initialize_serial(device->descriptor, B115200, 0, arguments.flow); // set speed to 115,200 bps, 8n1 (no parity)
+
+            /** In raw mode stdout only carries the data of the device */
+
+            if(apply_tty_profile(device->descriptor, device->name, arguments.profile, arguments.raw ? stderr : stdout)) {
+                close_devices();
+                return -1;
+            }
+
+            session_init(&device->session, device->descriptor);
 
+            /** The module boots at 115200, the one-shot CMD mode operations gain nothing from a faster link */
+
+            int link_mode = arguments.mode == COMMUNICATE || arguments.mode == BENCH || arguments.mode == SEND_FILE
+                || arguments.mode == RECV_FILE || arguments.mode == DAEMON || arguments.mode == ATTACK;
+
+            if(arguments.baud != MODULE_DEFAULT_BAUD && link_mode) {
+                if(negotiate_baud(device, find_baud_rate(arguments.baud)) < 0) {
+                    close_devices();
+                    return -1;
+                }
                 #ifdef DEBUG
-                    printf("DEBUG: Device has entereed comand mode succesfully!\n");
+                    printf("DEBUG: %s running at %d baud\n", device->name, device->baud);
                 #endif
+            }
+        }
+
+        if(arguments.flush_size < 0)
+            arguments.flush_size = arguments.profile->write_chunk;
 
-                if(!connect_to_ble_address(device_descriptor, arguments.formatted_mac))
-                    printf("The device has connected to %s succesfully!\n", arguments.ble_address);
+        /** The modes below the fleet operations drive the first and only device */
+
+        struct pmod_device* device = &DEVICES[0];
+        char* device_name = device->name;
+        int device_descriptor = device->descriptor;
+        struct cmd_session* session = &device->session;
+
+        //char* recv_buffer = malloc(sizeof(char) * 256);
+
+    #endif
+
+    /** Devices whose fleet operation failed, the exit status tells a script */
+
+    int failed_devices = 0;
+
+    /** Connect to a given Ble Device address */
+
+    if(arguments.mode == CONNECT && arguments.ble_address) {
+
+        #ifdef RELEASE
+
+            printf("Entering comand mode...\n");
+
+            /** Connect and leave CMD mode in the same round trip, on every device at once */
+
+            struct cmd_request* connect_requests[MAX_DEVICES];
+            for(int i = 0; i < DEVICE_COUNT; i++) {
+                connect_requests[i] = connect_to_ble_address(&DEVICES[i].session, arguments.formatted_mac);
+                queue_exit_device_cmd_mode(&DEVICES[i].session);
+            }
+            fleet_run(DEVICES, DEVICE_COUNT);
+
+            for(int i = 0; i < DEVICE_COUNT; i++) {
+                if(!strncmp(connect_requests[i]->response, "AOK", 3))
+                    fleet_report(&DEVICES[i], "The device has connected to %s succesfully!", peer_label);
                 else
-                    printf("Device could not connect to %s!\n", arguments.ble_address);
+                    fleet_report(&DEVICES[i], "Device could not connect to %s!", peer_label);
+                if(DEVICES[i].fleet_failed || strncmp(connect_requests[i]->response, "AOK", 3))
+                    failed_devices++;
             }
 
         #endif
@@ -648,17 +5020,18 @@ int main(int argc, char* argv[]) {
 
         #ifdef RELEASE
 
-            if(!enter_device_cmd_mode(device_descriptor)) {
+            if(!session_open(session)) {
 
                 /** Function to start the attack  */
 
                 printf("Attack on %s will start...\n", arguments.ble_address);
 
                 while(keep_running) {
-                    connect_to_ble_address(device_descriptor, arguments.formatted_mac);
+                    connect_to_ble_address(session, arguments.formatted_mac);
+                    session_flush(session);
                 }
 
-                exit_device_cmd_mode(device_descriptor);
+                session_close(session);
 
 
                 printf("Attack has been stopped...\n", arguments.ble_address);
@@ -674,16 +5047,21 @@ int main(int argc, char* argv[]) {
     if(arguments.mode == DISCONNECT) { 
         #ifdef RELEASE
             printf("Entering comand mode...\n");
-            if(!enter_device_cmd_mode(device_descriptor)) {
 
-                #ifdef DEBUG
-                    printf("DEBUG: Device has entereed comand mode succesfully!\n");
-                #endif
+            struct cmd_request* disconnect_requests[MAX_DEVICES];
+            for(int i = 0; i < DEVICE_COUNT; i++) {
+                disconnect_requests[i] = disconnect_from_ble(&DEVICES[i].session);
+                queue_exit_device_cmd_mode(&DEVICES[i].session);
+            }
+            fleet_run(DEVICES, DEVICE_COUNT);
 
-                if(!disconnect_from_ble(device_descriptor))
-                    printf("The device has disconnected succesfully!\n");
+            for(int i = 0; i < DEVICE_COUNT; i++) {
+                if(!strncmp(disconnect_requests[i]->response, "KILL", 4))
+                    fleet_report(&DEVICES[i], "The device has disconnected succesfully!");
                 else
-                    printf("Device could not disconnect!\n");
+                    fleet_report(&DEVICES[i], "Device could not disconnect!");
+                if(DEVICES[i].fleet_failed || strncmp(disconnect_requests[i]->response, "KILL", 4))
+                    failed_devices++;
             }
         #endif
     }
@@ -693,8 +5071,20 @@ int main(int argc, char* argv[]) {
     if(arguments.mode == EXITCMDMODE) { 
         #ifdef RELEASE
             printf("Exiting comand mode...\n");
-            if(!exit_device_cmd_mode(device_descriptor)) {
-                printf("Device has exited CMD mode succesfully!\n");
+
+            /** The modules are taken to be stuck in CMD mode, only the END of "---" tells */
+
+            struct cmd_request* exit_requests[MAX_DEVICES];
+            for(int i = 0; i < DEVICE_COUNT; i++) {
+                DEVICES[i].session.in_cmd_mode = 1;
+                exit_requests[i] = queue_exit_device_cmd_mode(&DEVICES[i].session);
+            }
+            failed_devices = fleet_run(DEVICES, DEVICE_COUNT);
+
+            for(int i = 0; i < DEVICE_COUNT; i++) {
+                DEVICES[i].session.in_cmd_mode = 0;
+                if(!strncmp(exit_requests[i]->response, "END", 3))
+                    fleet_report(&DEVICES[i], "Device has exited CMD mode succesfully!");
             }
         #endif
     }
@@ -704,11 +5094,101 @@ int main(int argc, char* argv[]) {
     if(arguments.mode == REBOOT) { 
         #ifdef RELEASE
             printf("Restarting device..\n");
-            if(!enter_device_cmd_mode(device_descriptor)) {
-                #ifdef DEBUG
-                    printf("DEBUG: Device has entereed comand mode succesfully!\n");
-                #endif
-                restart_device(device_descriptor);
+            for(int i = 0; i < DEVICE_COUNT; i++)
+                restart_device(&DEVICES[i].session);
+            failed_devices = fleet_run(DEVICES, DEVICE_COUNT);
+        #endif
+    }
+
+    /** Connection status of every device */
+
+    if(arguments.mode == STATUS) {
+        #ifdef RELEASE
+            struct cmd_request* connected_requests[MAX_DEVICES];
+            struct cmd_request* address_requests[MAX_DEVICES];
+
+            for(int i = 0; i < DEVICE_COUNT; i++) {
+                connected_requests[i] = check_device_connected(&DEVICES[i].session);
+                address_requests[i] = get_connected_address(&DEVICES[i].session);
+                queue_exit_device_cmd_mode(&DEVICES[i].session);
+            }
+            failed_devices = fleet_run(DEVICES, DEVICE_COUNT);
+
+            for(int i = 0; i < DEVICE_COUNT; i++) {
+                if(connected_requests[i]->response_size < 0)
+                    fleet_report(&DEVICES[i], "The device did not answer!");
+                else if(!strncmp(connected_requests[i]->response, "1,0,0", 5))
+                    fleet_report(&DEVICES[i], "The device is connected to %s", address_requests[i]->response);
+                else
+                    fleet_report(&DEVICES[i], "The device is not connected");
+            }
+        #endif
+    }
+
+    /** Scan for the peers in range and cache them for --connect */
+
+    if(arguments.mode == INQUIRY) {
+        #ifdef RELEASE
+            printf("Inquiry for %d s...\n", arguments.inquiry_rssi ? INQUIRY_DEFAULT_SECONDS : arguments.inquiry_seconds);
+            if(run_inquiry(device, arguments.inquiry_seconds, arguments.inquiry_rssi, arguments.peer_cache_path, arguments.peer_ttl) < 0) {
+                close_devices();
+                return -1;
+            }
+        #endif
+    }
+
+    /** Keep the device open and serve the clients of the Unix socket */
+
+    if(arguments.mode == DAEMON) {
+        #ifdef RELEASE
+            printf("Serving %s on %s\n", device_name, arguments.socket_path);
+            rt_apply("Reader", RT.priority);
+            if(run_daemon(session, arguments.socket_path)) {
+                do_cleanup(device);
+                close(device_descriptor);
+                return -1;
+            }
+        #endif
+    }
+
+    /** Measure the link or move a file, both need the peer in data mode */
+
+    if(arguments.mode == BENCH || arguments.mode == SEND_FILE || arguments.mode == RECV_FILE) {
+        #ifdef RELEASE
+            if(session_open(session)) {
+                close(device_descriptor);
+                return -1;
+            }
+
+            struct cmd_request* connected_request = check_device_connected(session);
+            queue_exit_device_cmd_mode(session);
+            session_flush(session);
+
+            if(strncmp(connected_request->response, "1,0,0", 5)) {
+                printf("No peer is connected, connect first with -c!\n");
+                do_cleanup(device);
+                close(device_descriptor);
+                return -1;
+            }
+
+            struct tx_batch* batch = malloc(sizeof(struct tx_batch));
+            tx_batch_init(batch, device, arguments.flush_size, arguments.flush_delay_us);
+            rt_apply("Reader", RT.priority);
+
+            int status;
+            if(arguments.mode == SEND_FILE)
+                status = send_file(device_descriptor, batch, arguments.file_path);
+            else if(arguments.mode == RECV_FILE)
+                status = recv_file(device_descriptor, batch, arguments.file_path);
+            else
+                status = run_bench(device_descriptor, batch, &arguments.bench);
+            tx_batch_report(batch, stdout);
+            free(batch);
+
+            if(status) {
+                do_cleanup(device);
+                close(device_descriptor);
+                return -1;
             }
         #endif
     }
@@ -724,111 +5204,91 @@ int main(int argc, char* argv[]) {
         /** Start communication */
 
         #ifdef RELEASE
-            printf("Entering comand mode...\n");
+
+            /** In raw mode stdout only carries the data of the device */
+
+            FILE* status_output = arguments.raw ? stderr : stdout;
+
+            fprintf(status_output, "Entering comand mode...\n");
 
             /** Enter cmd mode and find whom we are talking to! */
 
-            if(!enter_device_cmd_mode(device_descriptor)) {
+            if(!session_open(session)) {
                 
                 #ifdef DEBUG
                     printf("DEBUG: Device has entereed comand mode succesfully!\n");
                 #endif
 
-                if(!check_device_connected(device_descriptor)) {
+                /** Status, peer address and exit of CMD mode in a single round trip */
+
+                struct cmd_request* connected_request = check_device_connected(session);
+                struct cmd_request* address_request = get_connected_address(session);
+                struct cmd_request* exit_request = queue_exit_device_cmd_mode(session);
+
+                session_flush(session);
+
+                if(!strncmp(connected_request->response, "1,0,0", 5)) {
 
                     #ifdef DEBUG
                         printf("The device is connected!\n");
                     #endif
 
-                    char* connection_buffer = calloc(256, sizeof(char));
-
-                    int cn_size = get_connected_address(device_descriptor, connection_buffer);
-
-                    if(cn_size)
-                        printf("You will talk with: %s\n", connection_buffer);
+                    if(address_request->response_size > 0)
+                        fprintf(status_output, "You will talk with: %s\n", address_request->response);
                     else {
                         printf("Something wen wrong!\n");
-                        free(connection_buffer);
-                        do_cleanup(device_descriptor);
+                        do_cleanup(device);
                         return -1;
                     }
                 } 
                 else
-                    printf("You will talk with the PmodBT2\n");
+                    fprintf(status_output, "You will talk with the PmodBT2\n");
 
-                if(!exit_device_cmd_mode(device_descriptor)) {
+                if(!strncmp(exit_request->response, "END", 3)) {
 
                     #ifdef DEBUG
                         printf("DEBUG: Device has exited CMD mode succesfully!\n");
                     #endif
 
-                    printf("> ");
-
-                    /** Start communication */
-
-                    char* user_buffer = calloc(256, sizeof(char));
+                    /** Raw mode moves the data unchanged and has no prompt */
 
-                    int user_buffer_size = 0;
-                    int sent_bytes  = 0;
+                    struct tx_batch* batch = malloc(sizeof(struct tx_batch));
+                    tx_batch_init(batch, device, arguments.flush_size, arguments.flush_delay_us);
+                    batch->flush_on_cr = !arguments.framed;
 
-                    pthread_t thread_id;
-                    pthread_create(&thread_id, NULL, thread_pooling_module, (void*)&device_descriptor);
-
-                    struct sigaction sa;        
-
-                    sa.sa_handler = handler;
-                    sigemptyset(&sa.sa_mask);
-                    sa.sa_flags = 0;
-                    sigaction(SIGALRM, &sa, NULL);
-
-                    while(keep_running) {
-
-                        /** Read buffer from user */
-
-                        if(scanf("%s", user_buffer) == 1) {
-                            user_buffer_size = strlen(user_buffer);
-                            if(user_buffer_size > 0) {
-
-                                /** Maybe put <cr><lf> at the end ot buffer  */
-
-                                if(strncmp(user_buffer, "$$$", 3)) {
-                                    user_buffer[user_buffer_size++] = 0xD;
-                                    user_buffer[user_buffer_size] = 0;
-                                }
-
-                                sent_bytes = send_message_to_device(device_descriptor, user_buffer, user_buffer_size);
-
-                                if(sent_bytes == user_buffer_size) {
-                                    usleep((user_buffer_size + 25) * 100); 
-                                } else {
-                                    printf("Err > Only %d bytes were sent!", sent_bytes);
-                                }
-                            }
-                        }
-                        printf("> ");
-                    }            
+                    if(arguments.raw) {
+                        rt_apply("Reader", RT.priority);
+                        int status = raw_pipe(device_descriptor, batch);
+                        free(batch);
+                        do_cleanup(device);
+                        close(device_descriptor);
+                        return status;
+                    }
 
-                    pthread_cancel(thread_id);
+                    printf("> ");
+                    fflush(stdout);
 
-                    #ifdef DEBUG
-                        printf("DEBUG: Thread has been canceled, waiting for join!\n");
-                    #endif
+                    /** Start communication */
 
-                    pthread_join(thread_id, NULL);
+                    pthread_t receive_threads[RX_THREADS];
+                    struct rx_ring* receive_ring = start_receive_threads(device_descriptor, arguments.oled_name, arguments.oled_fps, arguments.framed, receive_threads);
 
+                    token_loop(batch, receive_ring, arguments.framed, arguments.compress, status_output);
 
-                    free(user_buffer);
+                    stop_receive_threads(receive_ring, receive_threads);
+                    tx_batch_report(batch, stdout);
+                    free(batch);
 
                 } else {
                     printf("Something wen wrong!\n");
-                    do_cleanup(device_descriptor);
+                    do_cleanup(device);
                     return -1;
                 }
 
 
             } else {
                 printf("Something wen wrong!\n");
-                do_cleanup(device_descriptor);
+                do_cleanup(device);
                 return -1;
             }
 
@@ -838,11 +5298,10 @@ int main(int argc, char* argv[]) {
 
 #pragma endregion COMMUNICATE
 
-    /** Before exiting we must reset the device to exit from command mode */
+    /** Before exiting we must reset the devices to exit from command mode */
     #ifdef RELEASE
-        do_cleanup(device_descriptor);
-        close(device_descriptor);
+        close_devices();
     #endif
 
-    return 0;
+    return failed_devices ? -1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,593 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <argp.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+/**
+ * Simulated RN-42 / PmodBT2 module on a pseudo-terminal. pmodbt runs against the printed
+ * slave device (--device), the simulator answers the CMD mode commands and, while a peer
+ * is connected, echoes the data mode bytes back as the remote device would. With --peer-link
+ * a second module runs on a second pseudo-terminal and the two are connected to each other
+ * instead, the data mode bytes of one come out of the other. A module only understands
+ * pmodbt while the speed of the tty matches its own UART speed.
+ */
+
+/** Variable for detecting CTRL-C */
+
+static volatile int keep_running = 1;
+
+const char *argp_program_version = "PmodBT2 RN-42 simulator 0.1";
+const char *argp_program_bug_address = "claudiu.ghenea15@yahoo.ro";
+
+static char doc[] = "Simulated RN-42 Bluetooth module on a pseudo-terminal, for tests and benchmarks without the board.";
+static char args_doc[] = "";
+
+static struct argp_option options[] = {
+    { "link", 'l', "[Path]", 0, "Symbolic link to the pseudo-terminal, e.g. /tmp/ttyPS1."},
+    { "peer-link", 'p', "[Path]", 0, "Run a second module on this symbolic link, connected to the first one instead of the echo."},
+    { "latency", 't', "[Microseconds]", 0, "Processing time of the module before every CMD mode response (default 0)."},
+    { "chunk", 'k', "[Bytes]", 0, "Send the responses in chunks of this size (default whole responses)."},
+    { "chunk-gap", 'g', "[Microseconds]", 0, "Pause between the chunks of a response (default 1000)."},
+    { "error-rate", 'e', "[Percent]", 0, "Answer this percentage of the commands with ERR."},
+    { "drop-rate", 'x', "[Percent]", 0, "Do not answer this percentage of the commands."},
+    { "connected", 'c', "[Address]", 0, "Start connected to the given peer address, 12 hex digits."},
+    { "corrupt", 'r', "[Per million]", 0, "Flip a bit in this many of every million data mode bytes passed on."},
+    { "sink", 's', 0, 0, "The connected peer drops the data instead of echoing it."},
+    { "fixed-baud", 'f', 0, 0, "Acknowledge the U command but keep the current baud rate."},
+    { "neighbours", 'n', "[Count]", 0, "Peers in range that an inquiry finds, 0 - 4 (default 4)."},
+    { "inquiry-time", 'q', "[Milliseconds]", 0, "Length of an inquiry scan, every name takes a tenth of it more (default the time of the command)."},
+    { "verbose", 'v', 0, 0, "Print every command and its response."},
+    { 0 }
+};
+
+struct arguments {
+    char* link_path;
+    char* peer_link_path;
+    int latency_us;
+    int chunk_size;
+    int chunk_gap_us;
+    int error_rate;
+    int drop_rate;
+    int corrupt_ppm;
+    char* connected_address;
+    int sink;
+    int fixed_baud;
+    int neighbours;
+    int inquiry_ms;
+    int verbose;
+};
+
+/**
+ * UART speeds of the module, the token is the rate as the U command takes it
+ */
+struct baud_rate {
+    int rate;
+    speed_t speed;
+    const char* token;
+};
+
+static const struct baud_rate baud_rates[] = {
+    { 1200, B1200, "1200" },
+    { 2400, B2400, "2400" },
+    { 4800, B4800, "4800" },
+    { 9600, B9600, "9600" },
+    { 19200, B19200, "19.2" },
+    { 38400, B38400, "38.4" },
+    { 57600, B57600, "57.6" },
+    { 115200, B115200, "115K" },
+    { 230400, B230400, "230K" },
+    { 460800, B460800, "460K" },
+    { 921600, B921600, "921K" },
+};
+
+/**
+ * Peers in range of the simulated module, found by the I, IN and IQ inquiries
+ */
+struct neighbour {
+    const char* address;
+    const char* name;
+    const char* cod;
+    int rssi;
+};
+
+static const struct neighbour neighbours[] = {
+    { "0006664AB123", "PmodBT2-B123", "1F00", -48 },
+    { "0006664C7E01", "PmodBT2-7E01", "1F00", -61 },
+    { "001A7DDA7113", "Lab-Laptop", "5A020C", -70 },
+    { "B8278B4F20A9", "Rack-Sensor-3", "1F00", -83 },
+};
+
+#define NEIGHBOUR_COUNT (int)(sizeof(neighbours) / sizeof(neighbours[0]))
+
+/**
+ * State of the simulated module
+ */
+struct module {
+    struct module* peer;        // Gets the data mode bytes, NULL for the echo
+    int master;
+    int slave;
+    const struct baud_rate* baud;
+    int cmd_mode;
+    int connected;
+    char remote_address[13];
+    char input[256];            // Data of the current CMD mode line
+    int input_size;
+    unsigned long commands;
+    unsigned long echoed_bytes;
+    unsigned long corrupted_bytes;
+    unsigned long lost_bytes;
+    unsigned long garbled_reads;
+};
+
+/**
+ * Function: parse_opt
+ * ----------------------------
+ *  Function for parseing the input arguments used by the argp_parse and argp structure
+ */
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+
+    struct arguments *arguments = state->input;
+    switch (key) {
+    case 'l': arguments->link_path = arg; break;
+    case 'p': arguments->peer_link_path = arg; break;
+    case 't': arguments->latency_us = atoi(arg); break;
+    case 'k': arguments->chunk_size = atoi(arg); break;
+    case 'g': arguments->chunk_gap_us = atoi(arg); break;
+    case 'e': arguments->error_rate = atoi(arg); break;
+    case 'x': arguments->drop_rate = atoi(arg); break;
+    case 'r': arguments->corrupt_ppm = atoi(arg); break;
+    case 'c': arguments->connected_address = arg; break;
+    case 's': arguments->sink = 1; break;
+    case 'f': arguments->fixed_baud = 1; break;
+    case 'n':
+        arguments->neighbours = atoi(arg);
+        if(arguments->neighbours < 0 || arguments->neighbours > NEIGHBOUR_COUNT)
+            argp_error(state, "at most %d neighbours", NEIGHBOUR_COUNT);
+        break;
+    case 'q': arguments->inquiry_ms = atoi(arg); break;
+    case 'v': arguments->verbose = 1; break;
+    case ARGP_KEY_ARG: return 0;
+    default: return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+
+/**
+ * Function interrupt_handler
+ * ----------------------------
+ *  Handler for SIGINT and SIGTERM
+ */
+
+void interrupt_handler(int dummy) {
+    keep_running = 0;
+}
+
+/**
+ * Function: write_all
+ * ----------------------------
+ *  Write the buffer to a pseudo-terminal master. The masters are non-blocking, what does not
+ *  fit because nobody reads the other side is lost as it would be over the air.
+ *
+ *      @return Number of bytes lost
+ */
+
+int write_all(int fd, const char* buffer, int size) {
+
+    while(size > 0) {
+        int written = write(fd, buffer, size);
+        if(written < 0) {
+            if(errno == EINTR)
+                continue;
+            return size;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/**
+ * Function: respond
+ * ----------------------------
+ *  Send a response line after the module latency, in chunks when requested.
+ *      @param[in] module Simulated module
+ *      @param[in] arguments Simulation settings
+ *      @param[in] response Response without the <cr><lf>
+ */
+
+void respond(struct module* module, struct arguments* arguments, const char* response) {
+
+    char line[300];
+    int size = snprintf(line, sizeof(line), "%s\r\n", response);
+
+    if(arguments->latency_us > 0)
+        usleep(arguments->latency_us);
+
+    if(arguments->chunk_size <= 0) {
+        write_all(module->master, line, size);
+        return;
+    }
+
+    for(int offset = 0; offset < size; offset += arguments->chunk_size) {
+        int chunk = size - offset < arguments->chunk_size ? size - offset : arguments->chunk_size;
+        if(offset > 0)
+            usleep(arguments->chunk_gap_us);
+        write_all(module->master, line + offset, chunk);
+    }
+}
+
+/**
+ * Function: run_inquiry
+ * ----------------------------
+ *  Answer an inquiry as the module does: the scan is announced, the peers are counted once it
+ *  ends and their lines follow, with IN each one after the time its name request takes.
+ *      @param[in] module Simulated module
+ *      @param[in] arguments Simulation settings
+ *      @param[in] command I,<seconds>, IN,<seconds> or IQ
+ */
+
+void run_inquiry(struct module* module, struct arguments* arguments, char* command) {
+
+    char line[128];
+    int names = !strncmp(command, "IN", 2);
+    int rssi = !strncmp(command, "IQ", 2);
+    int seconds = command[names || rssi ? 2 : 1] == ',' ? atoi(command + (names || rssi ? 3 : 2)) : 10;
+
+    if(seconds < 1 || seconds > 48 || rssi)
+        seconds = 10;
+    int scan_us = arguments->inquiry_ms > 0 ? arguments->inquiry_ms * 1000 : seconds * 1000000;
+
+    if(arguments->verbose)
+        printf("%s -> inquiry of %d ms, %d peers\n", command, scan_us / 1000, arguments->neighbours);
+
+    snprintf(line, sizeof(line), "Inquiry,T=%d,COD=0", seconds);
+    respond(module, arguments, line);
+    usleep(scan_us);
+
+    if(arguments->neighbours == 0)
+        respond(module, arguments, "No Devices Found");
+    else {
+        snprintf(line, sizeof(line), "Found %d", arguments->neighbours);
+        respond(module, arguments, line);
+    }
+
+    for(int i = 0; i < arguments->neighbours; i++) {
+        const struct neighbour* peer = &neighbours[i];
+        if(names) {
+            usleep(scan_us / 10);
+            snprintf(line, sizeof(line), "%s,%s,%s", peer->address, peer->name, peer->cod);
+        }
+        else if(rssi)
+            snprintf(line, sizeof(line), "%s,%s,%02X", peer->address, peer->cod, peer->rssi & 0xFF);
+        else
+            snprintf(line, sizeof(line), "%s,%s", peer->address, peer->cod);
+        respond(module, arguments, line);
+    }
+    respond(module, arguments, "Inquiry Done");
+}
+
+/**
+ * Function: execute_command
+ * ----------------------------
+ *  Execute a CMD mode command line of the module.
+ *      @param[in] module Simulated module
+ *      @param[in] arguments Simulation settings
+ *      @param[in] command Command without the <cr>
+ */
+
+void execute_command(struct module* module, struct arguments* arguments, char* command) {
+
+    char response[64];
+
+    module->commands++;
+
+    if(arguments->drop_rate > 0 && rand() % 100 < arguments->drop_rate) {
+        if(arguments->verbose)
+            printf("%s -> (dropped)\n", command);
+        return;
+    }
+
+    if(arguments->error_rate > 0 && rand() % 100 < arguments->error_rate)
+        strcpy(response, "ERR");
+    else if(!strcmp(command, "I") || !strncmp(command, "I,", 2) || !strncmp(command, "IN", 2) || !strcmp(command, "IQ")) {
+        run_inquiry(module, arguments, command);
+        return;
+    }
+    else if(!strcmp(command, "---")) {
+        strcpy(response, "END");
+        module->cmd_mode = 0;
+    }
+    else if(!strncmp(command, "C,", 2)) {
+        if(strlen(command + 2) == 12 && strspn(command + 2, "0123456789abcdefABCDEF") == 12) {
+            strcpy(module->remote_address, command + 2);
+            module->connected = 1;
+            strcpy(response, "AOK");
+        }
+        else
+            strcpy(response, "ERR");
+    }
+    else if(!strcmp(command, "K,")) {
+        strcpy(response, module->connected ? "KILL" : "ERR");
+        module->connected = 0;
+    }
+    else if(!strcmp(command, "GK"))
+        strcpy(response, module->connected ? "1,0,0" : "0,0,0");
+    else if(!strcmp(command, "GR"))
+        strcpy(response, module->connected ? module->remote_address : "000000000000");
+    else if(!strncmp(command, "U,", 2)) {
+        const struct baud_rate* rate = NULL;
+        for(int i = 0; i < (int)(sizeof(baud_rates) / sizeof(baud_rates[0])); i++)
+            if(!strncmp(command + 2, baud_rates[i].token, 4) && command[6] == ',' && strchr("NEO", command[7]) && command[7])
+                rate = &baud_rates[i];
+        if(rate) {
+            strcpy(response, "AOK");
+            module->cmd_mode = 0;
+            if(!arguments->fixed_baud)
+                module->baud = rate; // Checked against the tty from the next read on
+        }
+        else
+            strcpy(response, "ERR");
+    }
+    else if(!strcmp(command, "R,1")) {
+        strcpy(response, "Reboot!");
+        module->cmd_mode = 0;
+        module->baud = &baud_rates[7];
+        module->connected = 0;
+    }
+    else
+        strcpy(response, "?");
+
+    if(arguments->verbose)
+        printf("%s -> %s\n", command, response);
+
+    respond(module, arguments, response);
+}
+
+/**
+ * Function: handle_input
+ * ----------------------------
+ *  Handle the bytes written by pmodbt. In data mode a write of just "$$$" enters CMD mode and everything else goes
+ *  to the connected peer, in CMD mode the bytes are collected into <cr> terminated commands.
+ *      @param[in] module Simulated module
+ *      @param[in] arguments Simulation settings
+ *      @param[in] data Bytes written to the module
+ *      @param[in] size Number of bytes
+ */
+
+void handle_input(struct module* module, struct arguments* arguments, char* data, int size) {
+
+    /** The module tells the escape from data by the guard time around it, pmodbt writes it alone */
+
+    if(!module->cmd_mode && size == 3 && !memcmp(data, "$$$", 3)) {
+        module->cmd_mode = 1;
+        if(arguments->verbose)
+            printf("$$$ -> CMD\n");
+        respond(module, arguments, "CMD");
+        return;
+    }
+
+    for(int i = 0; i < size; i++) {
+
+        char byte = data[i];
+
+        if(module->cmd_mode) {
+            if(byte == 0x0D || byte == 0x0A) {
+                module->input[module->input_size] = 0;
+                if(module->input_size > 0)
+                    execute_command(module, arguments, module->input);
+                module->input_size = 0;
+            }
+            else if(module->input_size < (int)sizeof(module->input) - 1)
+                module->input[module->input_size++] = byte;
+            continue;
+        }
+
+        if(module->connected && !arguments->sink) {
+            int output = module->peer ? module->peer->master : module->master;
+            if(arguments->corrupt_ppm > 0 && rand() % 1000000 < arguments->corrupt_ppm) {
+                byte ^= 1 << (rand() % 8);
+                module->corrupted_bytes++;
+            }
+            module->lost_bytes += write_all(output, &byte, 1);
+            module->echoed_bytes++;
+        }
+    }
+}
+
+/**
+ * Function: speed_matches
+ * ----------------------------
+ *  A pseudo-terminal moves the bytes at any speed, compare the speed pmodbt set on the tty
+ *  with the UART speed of the module instead.
+ *      @param[in] module Simulated module
+ *
+ *      @return 1 if the module would understand the bytes and 0 otherwise
+ */
+
+int speed_matches(struct module* module) {
+
+    struct termios tty;
+
+    if(tcgetattr(module->slave, &tty))
+        return 1;
+    return cfgetispeed(&tty) == module->baud->speed && cfgetospeed(&tty) == module->baud->speed;
+}
+
+/**
+ * Function: open_pseudo_terminal
+ * ----------------------------
+ *  Open the pseudo-terminal pair, the slave is kept open so the master never sees a hang up
+ *  between two pmodbt runs.
+ *      @param[out] slave_name Path of the slave device
+ *      @param[out] slave File descriptor of the slave kept open
+ *
+ *      @return File descriptor of the master or -1 on error
+ */
+
+int open_pseudo_terminal(char** slave_name, int* slave) {
+
+    struct termios tty;
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) || unlockpt(master) || (*slave_name = ptsname(master)) == NULL)
+        return -1;
+
+    *slave = open(*slave_name, O_RDWR | O_NOCTTY);
+    if(*slave < 0)
+        return -1;
+
+    /** Raw until pmodbt configures it */
+
+    if(tcgetattr(*slave, &tty) == 0) {
+        cfmakeraw(&tty);
+        tcsetattr(*slave, TCSANOW, &tty);
+    }
+    return master;
+}
+
+/**
+ * Function: start_module
+ * ----------------------------
+ *  Bring up a module on a new pseudo-terminal and link it.
+ *      @param[out] module Simulated module
+ *      @param[in] arguments Simulation settings
+ *      @param[in] link_path Symbolic link to the pseudo-terminal, may be NULL
+ *
+ *      @return Path pmodbt has to open or NULL on error
+ */
+
+char* start_module(struct module* module, struct arguments* arguments, char* link_path) {
+
+    char* slave_name;
+
+    memset(module, 0, sizeof(*module));
+    module->baud = &baud_rates[7]; // 115200 after boot
+    if(arguments->connected_address) {
+        strncpy(module->remote_address, arguments->connected_address, 12);
+        module->connected = 1;
+    }
+
+    module->master = open_pseudo_terminal(&slave_name, &module->slave);
+    if(module->master < 0) {
+        printf("Error %d while opening the pseudo-terminal: %s\n", errno, strerror(errno));
+        return NULL;
+    }
+    fcntl(module->master, F_SETFL, fcntl(module->master, F_GETFL) | O_NONBLOCK);
+
+    if(link_path) {
+        unlink(link_path);
+        if(symlink(slave_name, link_path)) {
+            printf("Error %d while linking %s: %s\n", errno, link_path, strerror(errno));
+            return NULL;
+        }
+        return link_path;
+    }
+    return slave_name;
+}
+
+int main(int argc, char* argv[]) {
+
+    struct arguments arguments;
+    struct module modules[2];
+    char buffer[4096];
+
+    memset(&arguments, 0, sizeof(arguments));
+    arguments.chunk_gap_us = 1000;
+    arguments.neighbours = NEIGHBOUR_COUNT;
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    int module_count = arguments.peer_link_path ? 2 : 1;
+    char* paths[2];
+
+    paths[0] = start_module(&modules[0], &arguments, arguments.link_path);
+    if(paths[0] == NULL)
+        return -1;
+    printf("%s\n", paths[0]);
+
+    if(module_count == 2) {
+        paths[1] = start_module(&modules[1], &arguments, arguments.peer_link_path);
+        if(paths[1] == NULL)
+            return -1;
+        printf("%s\n", paths[1]);
+        modules[0].peer = &modules[1];
+        modules[1].peer = &modules[0];
+    }
+
+    struct sigaction sa;
+    sa.sa_handler = interrupt_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    srand(time(NULL));
+    fflush(stdout);
+
+    struct pollfd master_poll[2];
+    for(int i = 0; i < module_count; i++) {
+        master_poll[i].fd = modules[i].master;
+        master_poll[i].events = POLLIN;
+    }
+
+    while(keep_running) {
+
+        if(poll(master_poll, module_count, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        for(int i = 0; i < module_count; i++) {
+
+            struct module* module = &modules[i];
+
+            if(!(master_poll[i].revents & POLLIN))
+                continue;
+
+            int size = read(module->master, buffer, sizeof(buffer));
+            if(size < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            if(size <= 0) {
+                keep_running = 0;
+                break;
+            }
+
+            if(!speed_matches(module)) {
+                module->garbled_reads++;
+                if(arguments.verbose)
+                    printf("%d bytes at the wrong speed, module runs at %d baud\n", size, module->baud->rate);
+                fflush(stdout);
+                continue;
+            }
+
+            handle_input(module, &arguments, buffer, size);
+            fflush(stdout);
+        }
+    }
+
+    for(int i = 0; i < module_count; i++) {
+        if(arguments.verbose)
+            printf("%s: %lu commands, %lu data bytes passed on, %lu corrupted, %lu lost, %lu reads at the wrong speed\n", paths[i],
+                modules[i].commands, modules[i].echoed_bytes, modules[i].corrupted_bytes, modules[i].lost_bytes, modules[i].garbled_reads);
+        close(modules[i].slave);
+        close(modules[i].master);
+    }
+
+    if(arguments.link_path)
+        unlink(arguments.link_path);
+    if(arguments.peer_link_path)
+        unlink(arguments.peer_link_path);
+    return 0;
+}
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <argp.h>
+#include <signal.h>
+#include <time.h>
+#include "uartTrace.h"
+
+/**
+ * Decoder of the capture files of pmodbt --trace-file. Every write to and read from the device
+ * is printed on one line with its wall clock time, the time since the previous line and the
+ * direction, the bytes as escaped text or as hex. The file can be read while pmodbt writes it.
+ */
+
+#define FOLLOW_INTERVAL_US 100000
+
+static volatile int keep_running = 1;
+
+const char *argp_program_version = "PmodBT2 trace decoder 0.1";
+const char *argp_program_bug_address = "claudiu.ghenea15@yahoo.ro";
+
+static char doc[] = "Print the UART traffic captured by pmodbt --trace-file.";
+static char args_doc[] = "TRACE_FILE";
+
+static struct argp_option options[] = {
+    { "hex", 'x', 0, 0, "Print the bytes as hex instead of escaped text."},
+    { "last", 'n', "[Calls]", 0, "Print only about the last this many writes and reads."},
+    { "follow", 'f', 0, 0, "Keep printing the traffic as it is captured, until CTRL-C."},
+    { "merge", 'm', "[Microseconds]", 0, "Print the calls of one direction on one line while they are at most this far apart, e.g. the byte reads of a response."},
+    { 0 }
+};
+
+struct arguments {
+    char* path;
+    int hex;
+    long last;
+    int follow;
+    long merge_us;
+};
+
+/** Where the printing stopped, a line can go on in the next pass of --follow */
+
+struct dump_state {
+    uint64_t previous_ns;           // Timestamp of the previous call, 0 before the first one
+    int direction;
+    int line_open;
+    int in_call;                    // The next record goes on with the call of the last one
+    uint64_t realtime_ns;           // Clock anchor of the run being printed, realtime 0 while unknown
+    uint64_t monotonic_ns;
+    uint64_t waited;                // Index + 1 of the record that was still pending at the end of a pass
+};
+
+static const char* direction_names[] = { "TX", "RX", "--" };
+
+/**
+ * Function: parse_opt
+ * ----------------------------
+ *  Parse the arguments of the decoder.
+ */
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+    case 'x': arguments->hex = 1; break;
+    case 'n': arguments->last = atol(arg); break;
+    case 'f': arguments->follow = 1; break;
+    case 'm': arguments->merge_us = atol(arg); break;
+    case ARGP_KEY_ARG:
+        if(arguments->path)
+            argp_usage(state);
+        arguments->path = arg;
+        break;
+    case ARGP_KEY_END:
+        if(arguments->path == NULL)
+            argp_usage(state);
+        break;
+    default: return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+
+void interrupt_handler(int dummy) {
+    keep_running = 0;
+}
+
+/**
+ * Function: print_bytes
+ * ----------------------------
+ *  Print the bytes of a record, the line goes on with the next record of the same call.
+ */
+
+void print_bytes(const unsigned char* data, int size, int hex) {
+
+    for(int i = 0; i < size; i++) {
+        if(hex)
+            printf(" %02X", data[i]);
+        else if(data[i] == '\r')
+            printf("\\r");
+        else if(data[i] == '\n')
+            printf("\\n");
+        else if(data[i] == '\\')
+            printf("\\\\");
+        else if(data[i] >= 0x20 && data[i] < 0x7F)
+            putchar(data[i]);
+        else
+            printf("\\x%02X", data[i]);
+    }
+}
+
+/**
+ * Function: set_clock
+ * ----------------------------
+ *  Take the clock anchor of a TRACE_CLOCK record for the records after it.
+ */
+
+void set_clock(struct dump_state* state, struct trace_record* record) {
+
+    if(record->size < sizeof(uint64_t))
+        return;
+    memcpy(&state->realtime_ns, record->data, sizeof(uint64_t));
+    state->monotonic_ns = record->timestamp_ns;
+}
+
+/**
+ * Function: find_clock
+ * ----------------------------
+ *  Find the clock anchor of the run a record belongs to, the last TRACE_CLOCK before it. The
+ *  header holds the anchor of the traces written before there were TRACE_CLOCK records.
+ *      @param[in] trace Trace
+ *      @param[in] first Oldest record left
+ *      @param[in] index Record to print first
+ *      @param[out] state Clock anchor
+ */
+
+void find_clock(struct uart_trace* trace, uint64_t first, uint64_t index, struct dump_state* state) {
+
+    struct trace_record record;
+
+    state->realtime_ns = trace->header->realtime_ns;
+    state->monotonic_ns = trace->header->monotonic_ns;
+
+    for(; first < index; first++) {
+        if(trace_read(trace, first, &record) && record.direction == TRACE_CLOCK)
+            set_clock(state, &record);
+    }
+}
+
+/**
+ * Function: print_records
+ * ----------------------------
+ *  Print the records from the index up to the head. With --follow a record a writer is still
+ *  filling ends the pass, the next pass starts with it; it is given up only if it is still
+ *  pending then.
+ *      @param[in] trace Trace
+ *      @param[in,out] index First record, the record after the last one printed on return
+ *      @param[in] head Record after the last one
+ *      @param[in] arguments Format of the lines
+ *      @param[in,out] state Line and call printed last
+ *
+ *      @return Number of records that were overwritten or torn while they were read
+ */
+
+unsigned long print_records(struct uart_trace* trace, uint64_t* index, uint64_t head, struct arguments* arguments, struct dump_state* state) {
+
+    struct trace_record record;
+    unsigned long lost = 0;
+
+    for(; *index < head; (*index)++) {
+
+        if(!trace_read(trace, *index, &record)) {
+            if(arguments->follow && state->waited != *index + 1 && trace_pending(trace, *index)) {
+                state->waited = *index + 1;
+                break;
+            }
+            lost++;
+            if(state->line_open)
+                putchar('\n');
+            state->line_open = state->in_call = 0;
+            continue;
+        }
+
+        /** Not printed, the calls after it are a new run, maybe after a reboot */
+
+        if(!state->in_call && record.direction == TRACE_CLOCK) {
+            set_clock(state, &record);
+            state->previous_ns = 0;
+            continue;
+        }
+
+        /** The records after the first one of a call only add bytes */
+
+        if(!state->in_call) {
+            int64_t delta_ns = state->previous_ns ? (int64_t)(record.timestamp_ns - state->previous_ns) : 0;
+            int merged = state->line_open && record.direction == state->direction && record.direction != TRACE_NOTE
+                && delta_ns <= arguments->merge_us * 1000;
+
+            if(state->line_open && !merged)
+                putchar('\n');
+
+            if(!merged) {
+                uint64_t realtime = state->realtime_ns + (record.timestamp_ns - state->monotonic_ns);
+                time_t seconds = realtime / 1000000000ull;
+                struct tm local;
+                char date[32];
+
+                /** Without the anchor of the run only the time since its boot is known */
+
+                localtime_r(&seconds, &local);
+                if(state->realtime_ns)
+                    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+                else {
+                    realtime = record.timestamp_ns;
+                    snprintf(date, sizeof(date), "%19llu", (unsigned long long)(realtime / 1000000000ull));
+                }
+                printf("%s.%06llu %+12.1f us %s ", date, (unsigned long long)(realtime % 1000000000ull) / 1000,
+                    delta_ns / 1e3, direction_names[record.direction < 3 ? record.direction : 2]);
+            }
+            state->previous_ns = record.timestamp_ns;
+            state->direction = record.direction;
+        }
+
+        print_bytes(record.data, record.size, arguments->hex && record.direction != TRACE_NOTE);
+
+        state->in_call = record.flags & TRACE_FLAG_CONTINUED;
+        state->line_open = 1;
+        if(!state->in_call && arguments->merge_us < 0) {
+            putchar('\n');
+            state->line_open = 0;
+        }
+    }
+    return lost;
+}
+
+int main(int argc, char* argv[]) {
+
+    struct arguments arguments = { NULL, 0, 0, 0, -1 };
+    struct dump_state state = { 0, 0, 0, 0, 0, 0, 0 };
+    struct uart_trace trace;
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if(trace_open(&trace, arguments.path, 0, 0)) {
+        printf("Error %d while opening the trace %s! (\"main::trace_open\")\n", errno, arguments.path);
+        return -1;
+    }
+
+    signal(SIGINT, interrupt_handler);
+
+    uint64_t record_count = trace.header->record_count;
+    uint64_t head = atomic_load_explicit(&trace.header->head, memory_order_acquire);
+    uint64_t first = head > record_count ? head - record_count : 0;
+    uint64_t index = first;
+
+    /** A call takes one record most of the time, longer ones are cut at the start */
+
+    if(arguments.last > 0 && head - index > (uint64_t)arguments.last)
+        index = head - arguments.last;
+
+    find_clock(&trace, first, index, &state);
+    unsigned long lost = print_records(&trace, &index, head, &arguments, &state);
+
+    while(arguments.follow && keep_running) {
+        fflush(stdout);
+        usleep(FOLLOW_INTERVAL_US);
+
+        head = atomic_load_explicit(&trace.header->head, memory_order_acquire);
+        if(head - index > record_count)
+            index = head - record_count;
+        lost += print_records(&trace, &index, head, &arguments, &state);
+    }
+
+    if(state.line_open)
+        putchar('\n');
+    fflush(stdout);
+
+    fprintf(stderr, "%llu records captured in total, %lu skipped as overwritten or incomplete\n",
+        (unsigned long long)head, lost);
+
+    trace_close(&trace);
+    return 0;
+}
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <argp.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include "uartTrace.h"
+
+/**
+ * Replay of a pmodbt --trace-file capture on a pseudo-terminal, for repeatable benchmarks and
+ * regression tests of pmodbt without the board. The replay takes the place of the module: it
+ * sends what the module sent (RX in the trace) and waits for pmodbt to write what it wrote (TX),
+ * which is compared byte by byte. The writes of pmodbt are compared as one stream between two
+ * reads of the module, so a different batching of the same bytes still matches.
+ *
+ * The module bytes are sent with the recorded timing, scaled by --scale, or as soon as pmodbt has
+ * written what came before them with --asap. The time from a module read to the next write of
+ * pmodbt (its turnaround) is reported for the recording and for the replay. The stdin of pmodbt
+ * is not in the trace, the test has to give pmodbt the same input as in the recorded run.
+ */
+
+#define DEFAULT_TIMEOUT_MS 2000
+#define LINGER_MS 200               // Time after the last call for bytes pmodbt should not have written
+#define INPUT_SIZE 65536
+#define MISMATCH_CONTEXT 32         // Bytes printed from the first difference on
+
+static volatile int keep_running = 1;
+
+const char *argp_program_version = "PmodBT2 trace replay 0.1";
+const char *argp_program_bug_address = "claudiu.ghenea15@yahoo.ro";
+
+static char doc[] = "Replay a pmodbt --trace-file capture on a pseudo-terminal and check what pmodbt writes.";
+static char args_doc[] = "TRACE_FILE";
+
+static struct argp_option options[] = {
+    { "link", 'l', "[Path]", 0, "Symbolic link to the pseudo-terminal, e.g. /tmp/ttyPS1."},
+    { "scale", 's', "[Factor]", 0, "Replay this many times faster than recorded (default 1)."},
+    { "asap", 'a', 0, 0, "Send the module bytes as soon as pmodbt has written what came before them."},
+    { "run", 'r', "[Number]", 0, "Replay this run of pmodbt in the trace, 1 is the oldest one kept (default the last one)."},
+    { "timeout", 't', "[Milliseconds]", 0, "Wait this long for every write of pmodbt (default 2000)."},
+    { "verbose", 'v', 0, 0, "Print every call as it is replayed."},
+    { 0 }
+};
+
+struct arguments {
+    char* path;
+    char* link_path;
+    double scale;
+    int asap;
+    int run;
+    int timeout_ms;
+    int verbose;
+};
+
+/**
+ * A write or read of pmodbt in the trace, the records of one call put together
+ */
+struct trace_call {
+    uint64_t timestamp_ns;
+    int direction;
+    int size;
+    unsigned char* data;
+};
+
+/**
+ * Bytes written by pmodbt and not compared yet, with the time each of them arrived
+ */
+struct replay_input {
+    unsigned char data[INPUT_SIZE];
+    uint64_t arrival_ns[INPUT_SIZE];
+    int start;
+    int size;
+};
+
+/**
+ * Results of a replay
+ */
+struct replay_report {
+    unsigned long expected_calls;
+    unsigned long device_calls;
+    unsigned long mismatches;
+    unsigned long timeouts;
+    unsigned long extra_bytes;
+    unsigned long samples;
+    uint64_t started_ns;            // First byte from either side
+    uint64_t finished_ns;           // Last call replayed
+    double* recorded_us;            // Turnarounds as recorded
+    double* replayed_us;            // The same turnarounds in the replay
+};
+
+/**
+ * Function: parse_opt
+ * ----------------------------
+ *  Parse the arguments of the replay.
+ */
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+    case 'l': arguments->link_path = arg; break;
+    case 's': arguments->scale = atof(arg); break;
+    case 'a': arguments->asap = 1; break;
+    case 'r': arguments->run = atoi(arg); break;
+    case 't': arguments->timeout_ms = atoi(arg); break;
+    case 'v': arguments->verbose = 1; break;
+    case ARGP_KEY_ARG:
+        if(arguments->path)
+            argp_usage(state);
+        arguments->path = arg;
+        break;
+    case ARGP_KEY_END:
+        if(arguments->path == NULL || arguments->scale <= 0)
+            argp_usage(state);
+        break;
+    default: return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+
+void interrupt_handler(int dummy) {
+    keep_running = 0;
+}
+
+/**
+ * Function: print_escaped
+ * ----------------------------
+ *  Print bytes as tracedump does.
+ */
+
+void print_escaped(const unsigned char* data, int size) {
+
+    for(int i = 0; i < size; i++) {
+        if(data[i] == '\r')
+            printf("\\r");
+        else if(data[i] == '\n')
+            printf("\\n");
+        else if(data[i] >= 0x20 && data[i] < 0x7F)
+            putchar(data[i]);
+        else
+            printf("\\x%02X", data[i]);
+    }
+}
+
+/**
+ * Function: load_calls
+ * ----------------------------
+ *  Put the records of one run of pmodbt together into its calls. A run starts with the note
+ *  pmodbt writes after opening the trace, the oldest run may have lost its start to the ring.
+ *      @param[in] trace Trace
+ *      @param[in] run Run to load, 1 for the oldest one, 0 for the last one
+ *      @param[out] call_count Number of calls
+ *
+ *      @return Calls of the run or NULL if the trace has no such run
+ */
+
+struct trace_call* load_calls(struct uart_trace* trace, int run, int* call_count) {
+
+    uint64_t record_count = trace->header->record_count;
+    uint64_t head = atomic_load_explicit(&trace->header->head, memory_order_acquire);
+    uint64_t first = head > record_count ? head - record_count : 0;
+    struct trace_record record;
+    int runs = 0, in_call = 0;
+
+    /** Count the runs first, run 0 is the last one */
+
+    for(uint64_t index = first; index < head; index++) {
+        if(!trace_read(trace, index, &record)) {
+            in_call = 0;
+            continue;
+        }
+        if(!in_call && record.direction == TRACE_NOTE && !strncmp((char*)record.data, "pmodbt ", 7))
+            runs++;
+        in_call = record.flags & TRACE_FLAG_CONTINUED;
+    }
+
+    /** Without any start left, the whole trace is the one run whose start was overwritten */
+
+    int current = runs ? 0 : 1;
+    if(runs == 0)
+        runs = 1;
+    if(run == 0)
+        run = runs;
+    if(run > runs)
+        return NULL;
+
+    struct trace_call* calls = NULL;
+    int count = 0, capacity = 0;
+
+    in_call = 0;
+    for(uint64_t index = first; index < head; index++) {
+
+        if(!trace_read(trace, index, &record)) {
+            in_call = 0;
+            continue;
+        }
+
+        if(record.direction == TRACE_NOTE || record.direction == TRACE_CLOCK) {
+            if(!in_call && record.direction == TRACE_NOTE && !strncmp((char*)record.data, "pmodbt ", 7) && ++current > run)
+                break;
+            in_call = record.flags & TRACE_FLAG_CONTINUED;
+            continue;
+        }
+        if(current != run) {
+            in_call = record.flags & TRACE_FLAG_CONTINUED;
+            continue;
+        }
+
+        /** The records after the first one of a call only add bytes */
+
+        if(!in_call) {
+            if(count == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                calls = realloc(calls, capacity * sizeof(struct trace_call));
+            }
+            calls[count].timestamp_ns = record.timestamp_ns;
+            calls[count].direction = record.direction;
+            calls[count].size = 0;
+            calls[count].data = NULL;
+            count++;
+        }
+
+        struct trace_call* call = &calls[count - 1];
+        call->data = realloc(call->data, call->size + record.size);
+        memcpy(call->data + call->size, record.data, record.size);
+        call->size += record.size;
+
+        in_call = record.flags & TRACE_FLAG_CONTINUED;
+    }
+
+    *call_count = count;
+    return calls;
+}
+
+/**
+ * Function: open_pseudo_terminal
+ * ----------------------------
+ *  Open a pseudo-terminal in raw mode and keep its slave open, pmodbt finds it as rn42sim leaves it.
+ *      @param[out] slave_name Path of the slave device
+ *      @param[out] slave File descriptor of the slave kept open
+ *
+ *      @return File descriptor of the master or -1 on error
+ */
+
+int open_pseudo_terminal(char** slave_name, int* slave) {
+
+    struct termios tty;
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) || unlockpt(master) || (*slave_name = ptsname(master)) == NULL)
+        return -1;
+
+    *slave = open(*slave_name, O_RDWR | O_NOCTTY);
+    if(*slave < 0)
+        return -1;
+
+    if(tcgetattr(*slave, &tty) == 0) {
+        cfmakeraw(&tty);
+        tcsetattr(*slave, TCSANOW, &tty);
+    }
+    return master;
+}
+
+/**
+ * Function: receive_until
+ * ----------------------------
+ *  Collect what pmodbt writes until enough bytes are waiting or the deadline is reached.
+ *      @param[in] master Master of the pseudo-terminal
+ *      @param[in,out] input Bytes waiting to be compared
+ *      @param[in] wanted Return once this many bytes are waiting, 0 to wait for the deadline
+ *      @param[in] deadline_ns CLOCK_MONOTONIC deadline, 0 to wait without one
+ */
+
+void receive_until(int master, struct replay_input* input, int wanted, uint64_t deadline_ns) {
+
+    struct pollfd master_poll = { .fd = master, .events = POLLIN };
+
+    while(keep_running && (wanted == 0 || input->size - input->start < wanted)) {
+
+        int timeout_ms = -1;
+        if(deadline_ns) {
+            uint64_t now = trace_clock_ns(CLOCK_MONOTONIC);
+            if(now >= deadline_ns)
+                return;
+            timeout_ms = (deadline_ns - now + 999999) / 1000000;
+        }
+
+        /** Below a millisecond poll would sleep too long, the rest is spent spinning */
+
+        if(deadline_ns && timeout_ms <= 1)
+            timeout_ms = 0;
+
+        if(poll(&master_poll, 1, timeout_ms) < 0) {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        if(!(master_poll.revents & POLLIN))
+            continue;
+
+        if(input->start > 0 && input->size > INPUT_SIZE / 2) {
+            memmove(input->data, input->data + input->start, input->size - input->start);
+            memmove(input->arrival_ns, input->arrival_ns + input->start, (input->size - input->start) * sizeof(uint64_t));
+            input->size -= input->start;
+            input->start = 0;
+        }
+        if(input->size == INPUT_SIZE)
+            return;
+
+        int size = read(master, input->data + input->size, INPUT_SIZE - input->size);
+        if(size <= 0)
+            continue;
+
+        uint64_t now = trace_clock_ns(CLOCK_MONOTONIC);
+        for(int i = 0; i < size; i++)
+            input->arrival_ns[input->size + i] = now;
+        input->size += size;
+    }
+}
+
+/**
+ * Function: compare_double
+ * ----------------------------
+ *  qsort order of the latencies.
+ */
+
+int compare_double(const void* a, const void* b) {
+
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Function: print_latencies
+ * ----------------------------
+ *  Print the percentiles of a set of latencies, the set is sorted.
+ */
+
+void print_latencies(const char* name, double* samples, unsigned long count) {
+
+    if(count == 0)
+        return;
+    qsort(samples, count, sizeof(double), compare_double);
+    printf("%-28s p50 %9.1f us, p90 %9.1f us, p99 %9.1f us, max %9.1f us\n", name,
+        samples[count / 2], samples[count * 90 / 100], samples[count * 99 / 100], samples[count - 1]);
+}
+
+/**
+ * Function: replay
+ * ----------------------------
+ *  Play the module side of the calls on the pseudo-terminal.
+ *      @param[in] master Master of the pseudo-terminal
+ *      @param[in] calls Calls of the run
+ *      @param[in] call_count Number of calls
+ *      @param[in] arguments Replay settings
+ *      @param[out] report Results
+ */
+
+void replay(int master, struct trace_call* calls, int call_count, struct arguments* arguments, struct replay_report* report) {
+
+    struct replay_input* input = calloc(1, sizeof(struct replay_input));
+    uint64_t anchor_trace = calls[0].timestamp_ns, anchor_replay = 0;
+    uint64_t last_device_trace = 0, last_device_replay = 0;
+
+    report->recorded_us = malloc(call_count * sizeof(double));
+    report->replayed_us = malloc(call_count * sizeof(double));
+
+    for(int i = 0; i < call_count && keep_running; ) {
+
+        struct trace_call* call = &calls[i];
+
+        /** Module bytes, at their time relative to the last point both sides agree on */
+
+        if(call->direction == TRACE_RX) {
+            if(anchor_replay == 0)
+                anchor_replay = report->started_ns = trace_clock_ns(CLOCK_MONOTONIC);
+            if(!arguments->asap) {
+                uint64_t due = anchor_replay + (uint64_t)((call->timestamp_ns - anchor_trace) / arguments->scale);
+                receive_until(master, input, 0, due);
+            }
+            if(write(master, call->data, call->size) != call->size)
+                printf("Error %d while replaying call %d! (\"replay::write\")\n", errno, i);
+
+            last_device_trace = call->timestamp_ns;
+            last_device_replay = trace_clock_ns(CLOCK_MONOTONIC);
+            report->device_calls++;
+
+            if(arguments->verbose) {
+                printf("%6d RX ", i);
+                print_escaped(call->data, call->size);
+                putchar('\n');
+            }
+            i++;
+            continue;
+        }
+
+        /** The writes of pmodbt up to the next module bytes are one stream */
+
+        int first = i, expected_size = 0;
+        for(; i < call_count && calls[i].direction == TRACE_TX; i++)
+            expected_size += calls[i].size;
+
+        unsigned char* expected = malloc(expected_size);
+        int offset = 0;
+        for(int j = first; j < i; j++) {
+            memcpy(expected + offset, calls[j].data, calls[j].size);
+            offset += calls[j].size;
+        }
+
+        /** pmodbt is started after the replay, the first write has no deadline */
+
+        uint64_t deadline = anchor_replay ? trace_clock_ns(CLOCK_MONOTONIC) + (uint64_t)arguments->timeout_ms * 1000000 : 0;
+        uint64_t first_arrival = 0, last_arrival = 0;
+        int received = 0, difference = -1;
+
+        /** Compared and consumed as it comes in, the stream can be longer than the input buffer */
+
+        while(received < expected_size) {
+
+            int wanted = expected_size - received < INPUT_SIZE / 2 ? expected_size - received : INPUT_SIZE / 2;
+            receive_until(master, input, wanted, deadline);
+
+            int size = input->size - input->start;
+            if(size > expected_size - received)
+                size = expected_size - received;
+            if(size == 0)
+                break;
+
+            for(int j = 0; j < size && difference < 0; j++) {
+                if(input->data[input->start + j] != expected[received + j])
+                    difference = received + j;
+            }
+
+            if(difference >= received) {
+                int context = size - (difference - received);
+                if(context > MISMATCH_CONTEXT)
+                    context = MISMATCH_CONTEXT;
+                report->mismatches++;
+                printf("Mismatch at call %d, byte %d: expected \"", first, difference);
+                print_escaped(expected + difference, expected_size - difference < MISMATCH_CONTEXT ? expected_size - difference : MISMATCH_CONTEXT);
+                printf("\" got \"");
+                print_escaped(input->data + input->start + (difference - received), context);
+                printf("\"\n");
+            }
+
+            if(received == 0)
+                first_arrival = input->arrival_ns[input->start];
+            last_arrival = input->arrival_ns[input->start + size - 1];
+            input->start += size;
+            received += size;
+        }
+
+        /** A write that began before the last read came back answers stdin, not the module */
+
+        if(received > 0 && last_device_replay && calls[first].timestamp_ns >= last_device_trace) {
+            report->recorded_us[report->samples] = (calls[first].timestamp_ns - last_device_trace) / 1e3;
+            report->replayed_us[report->samples] = ((int64_t)first_arrival - (int64_t)last_device_replay) / 1e3;
+            report->samples++;
+        }
+
+        if(received < expected_size && difference < 0) {
+            report->timeouts++;
+            printf("Timeout at call %d: %d of %d bytes from pmodbt, waiting for \"", first, received, expected_size);
+            print_escaped(expected + received, expected_size - received < MISMATCH_CONTEXT ? expected_size - received : MISMATCH_CONTEXT);
+            printf("\"\n");
+        }
+        else if(difference < 0 && arguments->verbose) {
+            printf("%6d TX ", first);
+            print_escaped(expected, expected_size);
+            putchar('\n');
+        }
+
+        /** Both sides agree again once the last byte is in */
+
+        if(received > 0) {
+            if(report->started_ns == 0)
+                report->started_ns = first_arrival;
+            anchor_trace = calls[i - 1].timestamp_ns;
+            anchor_replay = last_arrival;
+        }
+        report->expected_calls += i - first;
+        free(expected);
+    }
+
+    report->finished_ns = trace_clock_ns(CLOCK_MONOTONIC);
+
+    /** Whatever comes after the end of the run was not in the recording */
+
+    receive_until(master, input, 0, trace_clock_ns(CLOCK_MONOTONIC) + LINGER_MS * 1000000ull);
+    report->extra_bytes = input->size - input->start;
+    if(report->extra_bytes) {
+        printf("%lu bytes from pmodbt after the end of the run: \"", report->extra_bytes);
+        print_escaped(input->data + input->start, report->extra_bytes < MISMATCH_CONTEXT ? report->extra_bytes : MISMATCH_CONTEXT);
+        printf("\"\n");
+    }
+    free(input);
+}
+
+int main(int argc, char* argv[]) {
+
+    struct arguments arguments = { NULL, NULL, 1.0, 0, 0, DEFAULT_TIMEOUT_MS, 0 };
+    struct replay_report report;
+    struct uart_trace trace;
+    char* slave_name;
+    int slave, call_count;
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if(trace_open(&trace, arguments.path, 0, 0)) {
+        printf("Error %d while opening the trace %s! (\"main::trace_open\")\n", errno, arguments.path);
+        return -1;
+    }
+
+    struct trace_call* calls = load_calls(&trace, arguments.run, &call_count);
+    if(calls == NULL || call_count == 0) {
+        printf("The trace has no run %d with traffic!\n", arguments.run);
+        return -1;
+    }
+
+    int master = open_pseudo_terminal(&slave_name, &slave);
+    if(master < 0) {
+        printf("Error %d while opening the pseudo-terminal: %s\n", errno, strerror(errno));
+        return -1;
+    }
+    if(arguments.link_path) {
+        unlink(arguments.link_path);
+        if(symlink(slave_name, arguments.link_path)) {
+            printf("Error %d while linking %s: %s\n", errno, arguments.link_path, strerror(errno));
+            return -1;
+        }
+    }
+    printf("%s\n", arguments.link_path ? arguments.link_path : slave_name);
+    fflush(stdout);
+
+    struct sigaction sa;
+    sa.sa_handler = interrupt_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    memset(&report, 0, sizeof(report));
+
+    replay(master, calls, call_count, &arguments, &report);
+
+    double recorded_s = (calls[call_count - 1].timestamp_ns - calls[0].timestamp_ns) / 1e9;
+    double replayed_s = report.started_ns ? (report.finished_ns - report.started_ns) / 1e9 : 0;
+
+    printf("Replayed %d calls, %lu writes of pmodbt and %lu reads of the module in %.3f s, recorded in %.3f s\n",
+        call_count, report.expected_calls, report.device_calls, replayed_s, recorded_s);
+    printf("%lu mismatches, %lu timeouts, %lu bytes after the end\n", report.mismatches, report.timeouts, report.extra_bytes);
+    print_latencies("Turnaround recorded:", report.recorded_us, report.samples);
+    print_latencies("Turnaround replayed:", report.replayed_us, report.samples);
+
+    close(slave);
+    close(master);
+    if(arguments.link_path)
+        unlink(arguments.link_path);
+    trace_close(&trace);
+
+    return report.mismatches || report.timeouts || report.extra_bytes || !keep_running ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+// LZ77 block codec for the framed data mode, in the block layout of LZ4. A block is a row of
+// sequences, each one a token (literal count in the high nibble, match length - 4 in the low
+// nibble, 15 continues in the bytes after it), the literals, the match offset (2 bytes LE) and
+// the rest of the match length. The last sequence has only literals. Blocks are small, so a
+// greedy single probe hash table is enough.
+
+#include <stdint.h>
+
+#define LZ_MAX_BLOCK_SIZE 4096      // Largest block before compression
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5          // The end of a block is always literals
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+/**
+ * Function: lz_read32
+ * ----------------------------
+ *  Read 4 bytes at any alignment.
+ */
+
+static inline uint32_t lz_read32(const unsigned char* data) {
+
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+/**
+ * Function: lz_write_length
+ * ----------------------------
+ *  Write the rest of a length that did not fit its nibble.
+ *
+ *      @return The output after the length or NULL if there is no room
+ */
+
+static inline unsigned char* lz_write_length(unsigned char* output, unsigned char* output_end, int length) {
+
+    for(; length >= 255; length -= 255) {
+        if(output >= output_end)
+            return NULL;
+        *output++ = 255;
+    }
+    if(output >= output_end)
+        return NULL;
+    *output++ = length;
+    return output;
+}
+
+/**
+ * Function: lz_write_sequence
+ * ----------------------------
+ *  Write the literals and, when match_length is not 0, the match after them.
+ *
+ *      @return The output after the sequence or NULL if there is no room
+ */
+
+static inline unsigned char* lz_write_sequence(unsigned char* output, unsigned char* output_end, const unsigned char* literals,
+    int literal_count, int offset, int match_length) {
+
+    if(output >= output_end)
+        return NULL;
+
+    unsigned char* token = output++;
+    int match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+    *token = (literal_count < 15 ? literal_count : 15) << 4 | (match_code < 15 ? match_code : 15);
+
+    if(literal_count >= 15 && (output = lz_write_length(output, output_end, literal_count - 15)) == NULL)
+        return NULL;
+    if(output + literal_count > output_end)
+        return NULL;
+    memcpy(output, literals, literal_count);
+    output += literal_count;
+
+    if(match_length == 0)
+        return output;
+
+    if(output + 2 > output_end)
+        return NULL;
+    *output++ = offset & 0xFF;
+    *output++ = offset >> 8;
+
+    if(match_code >= 15 && (output = lz_write_length(output, output_end, match_code - 15)) == NULL)
+        return NULL;
+    return output;
+}
+
+/**
+ * Function: lz_compress
+ * ----------------------------
+ *  Compress a block.
+ *      @param[in] input Block, at most LZ_MAX_BLOCK_SIZE bytes
+ *      @param[in] input_size Size of the block
+ *      @param[out] output Compressed block
+ *      @param[in] output_size Room for the compressed block
+ *
+ *      @return Size of the compressed block or -1 if it does not fit the output
+ */
+
+static inline int lz_compress(const unsigned char* input, int input_size, unsigned char* output, int output_size) {
+
+    uint16_t table[1 << LZ_HASH_BITS] = { 0 };  // Position + 1 of the last 4 bytes with the hash
+    unsigned char* out = output;
+    unsigned char* output_end = output + output_size;
+    int position = 0, anchor = 0;
+
+    if(input_size > LZ_MAX_BLOCK_SIZE)
+        return -1;
+
+    while(position + LZ_MIN_MATCH <= input_size - LZ_LAST_LITERALS) {
+
+        uint32_t sequence = lz_read32(input + position);
+        int hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int candidate = table[hash] - 1;
+
+        table[hash] = position + 1;
+
+        if(candidate < 0 || position - candidate > LZ_MAX_OFFSET || lz_read32(input + candidate) != sequence) {
+            position++;
+            continue;
+        }
+
+        int length = LZ_MIN_MATCH;
+        while(position + length < input_size - LZ_LAST_LITERALS && input[candidate + length] == input[position + length])
+            length++;
+
+        out = lz_write_sequence(out, output_end, input + anchor, position - anchor, position - candidate, length);
+        if(out == NULL)
+            return -1;
+
+        position += length;
+        anchor = position;
+    }
+
+    out = lz_write_sequence(out, output_end, input + anchor, input_size - anchor, 0, 0);
+    return out ? out - output : -1;
+}
+
+/**
+ * Function: lz_read_length
+ * ----------------------------
+ *  Read the rest of a length that did not fit its nibble.
+ *
+ *      @return The length or -1 if the block ends inside it
+ */
+
+static inline int lz_read_length(const unsigned char** input, const unsigned char* input_end, int length) {
+
+    while(1) {
+        if(*input >= input_end)
+            return -1;
+        unsigned char byte = *(*input)++;
+        length += byte;
+        if(byte != 255)
+            return length;
+    }
+}
+
+/**
+ * Function: lz_decompress
+ * ----------------------------
+ *  Decompress a block, every length and offset is checked against the buffers.
+ *      @param[in] input Compressed block
+ *      @param[in] input_size Size of the compressed block
+ *      @param[out] output Block
+ *      @param[in] output_size Room for the block
+ *
+ *      @return Size of the block or -1 if the compressed block is damaged
+ */
+
+static inline int lz_decompress(const unsigned char* input, int input_size, unsigned char* output, int output_size) {
+
+    const unsigned char* input_end = input + input_size;
+    unsigned char* out = output;
+    unsigned char* output_end = output + output_size;
+
+    while(input < input_end) {
+
+        unsigned char token = *input++;
+        int literal_count = token >> 4;
+
+        if(literal_count == 15 && (literal_count = lz_read_length(&input, input_end, 15)) < 0)
+            return -1;
+        if(literal_count > input_end - input || literal_count > output_end - out)
+            return -1;
+        memcpy(out, input, literal_count);
+        input += literal_count;
+        out += literal_count;
+
+        if(input == input_end)
+            break; // The last sequence has no match
+
+        if(input_end - input < 2)
+            return -1;
+        int offset = input[0] | input[1] << 8;
+        input += 2;
+
+        int match_length = token & 0x0F;
+        if(match_length == 15 && (match_length = lz_read_length(&input, input_end, 15)) < 0)
+            return -1;
+        match_length += LZ_MIN_MATCH;
+
+        if(offset == 0 || offset > out - output || match_length > output_end - out)
+            return -1;
+
+        /** The match may overlap what it writes */
+
+        const unsigned char* match = out - offset;
+        for(int i = 0; i < match_length; i++)
+            out[i] = match[i];
+        out += match_length;
+    }
+
+    return out - output;
+}
@@ -0,0 +1,261 @@
+// Capture of the UART traffic into a memory-mapped ring file. The file is a header and a
+// power of two count of 64 byte records; a write or read of the device takes one record per
+// TRACE_RECORD_DATA bytes, the records of one call are marked TRACE_FLAG_CONTINUED but the last.
+// A writer reserves its records with one atomic add on the head and publishes each of them by
+// storing its sequence (index + 1) last, so recording costs no system call and the writers
+// (the main thread and the reader thread) never wait for each other. A reader copies a record
+// and keeps it only if the sequence was the expected one before and after the copy. Every open
+// for writing starts with a TRACE_CLOCK record, the wall clock time of the records that follow.
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC "UARTTRC1"
+#define TRACE_VERSION 1
+#define TRACE_RECORD_DATA 44
+#define TRACE_DEFAULT_RECORDS 65536 // 4 MiB of records
+
+#define TRACE_TX 0                  // Written to the device
+#define TRACE_RX 1                  // Read from the device
+#define TRACE_NOTE 2                // Text of pmodbt itself, e.g. the start of a run
+#define TRACE_CLOCK 3               // CLOCK_REALTIME (8 bytes) at the timestamp of the record
+
+#define TRACE_FLAG_CONTINUED 0x01   // The next record holds more bytes of the same call
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_count;          // Power of two
+    uint64_t realtime_ns;           // CLOCK_REALTIME and CLOCK_MONOTONIC at the same instant, set by the
+    uint64_t monotonic_ns;          // writers before TRACE_CLOCK at their last open, 0 in newer traces
+    _Atomic uint64_t head;          // Records ever reserved
+    char reserved[24];
+};
+
+struct trace_record {
+    _Atomic uint64_t sequence;      // Index + 1 once the record is complete, 0 while it is written
+    uint64_t timestamp_ns;          // CLOCK_MONOTONIC
+    uint16_t size;
+    uint8_t direction;
+    uint8_t flags;
+    unsigned char data[TRACE_RECORD_DATA];
+};
+
+struct uart_trace {
+    struct trace_header* header;    // NULL while nothing is captured
+    struct trace_record* records;
+    size_t map_size;
+};
+
+/**
+ * Function: trace_clock_ns
+ * ----------------------------
+ *  Read a clock in nanoseconds, served from the vDSO without a system call.
+ */
+
+static inline uint64_t trace_clock_ns(clockid_t clock) {
+
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static inline void trace_write_at(struct uart_trace* trace, int direction, const void* data, ssize_t size, uint64_t timestamp);
+
+/**
+ * Function: trace_open
+ * ----------------------------
+ *  Map a trace file. For writing, a file of the same record count is continued so the runs
+ *  before a failure stay in it, anything else is replaced by an empty trace. The runs may be
+ *  apart by a reboot, each of them records its own TRACE_CLOCK.
+ *      @param[out] trace Mapped trace
+ *      @param[in] path Trace file
+ *      @param[in] record_count Records of a new trace, a power of two, ignored for reading
+ *      @param[in] writable Map for capturing instead of decoding
+ *
+ *      @return 0 on success and -1 on error, errno is kept
+ */
+
+static inline int trace_open(struct uart_trace* trace, const char* path, uint32_t record_count, int writable) {
+
+    struct stat status;
+    int fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+
+    if(fd < 0)
+        return -1;
+
+    if(fstat(fd, &status)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = sizeof(struct trace_header) + (size_t)record_count * sizeof(struct trace_record);
+    int fresh = 0;
+
+    if(writable && (size_t)status.st_size != size) {
+        if(ftruncate(fd, 0) || ftruncate(fd, size)) {
+            close(fd);
+            return -1;
+        }
+        fresh = 1;
+    }
+    if(!writable) {
+        size = status.st_size;
+        if(size < sizeof(struct trace_header)) {
+            close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    void* map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+
+    struct trace_header* header = map;
+
+    if(writable && (fresh || memcmp(header->magic, TRACE_MAGIC, 8) || header->version != TRACE_VERSION
+        || header->record_count != record_count)) {
+        memset(map, 0, size);
+        memcpy(header->magic, TRACE_MAGIC, 8);
+        header->version = TRACE_VERSION;
+        header->record_count = record_count;
+    }
+
+    if(memcmp(header->magic, TRACE_MAGIC, 8) || header->version != TRACE_VERSION
+        || (header->record_count & (header->record_count - 1))
+        || size < sizeof(struct trace_header) + (size_t)header->record_count * sizeof(struct trace_record)) {
+        munmap(map, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    trace->header = header;
+    trace->records = (struct trace_record*)(header + 1);
+    trace->map_size = size;
+
+    if(writable) {
+        uint64_t realtime = trace_clock_ns(CLOCK_REALTIME);
+        trace_write_at(trace, TRACE_CLOCK, &realtime, sizeof(realtime), trace_clock_ns(CLOCK_MONOTONIC));
+    }
+    return 0;
+}
+
+/**
+ * Function: trace_close
+ * ----------------------------
+ *  Unmap a trace, the kernel writes the pages back on its own.
+ */
+
+static inline void trace_close(struct uart_trace* trace) {
+
+    if(trace->header == NULL)
+        return;
+    munmap(trace->header, trace->map_size);
+    trace->header = NULL;
+}
+
+/**
+ * Function: trace_write_at
+ * ----------------------------
+ *  Capture the bytes of one call, nothing happens while no trace is open.
+ *      @param[in] trace Trace
+ *      @param[in] direction TRACE_TX, TRACE_RX or TRACE_NOTE
+ *      @param[in] data Bytes written or read
+ *      @param[in] size Result of the call, nothing is captured for errors
+ *      @param[in] timestamp CLOCK_MONOTONIC time of the call in nanoseconds
+ */
+
+static inline void trace_write_at(struct uart_trace* trace, int direction, const void* data, ssize_t size, uint64_t timestamp) {
+
+    if(trace->header == NULL || size <= 0)
+        return;
+
+    uint64_t count = (size + TRACE_RECORD_DATA - 1) / TRACE_RECORD_DATA;
+    uint64_t mask = trace->header->record_count - 1;
+    uint64_t index = atomic_fetch_add_explicit(&trace->header->head, count, memory_order_relaxed);
+    const unsigned char* bytes = data;
+
+    for(; size > 0; index++) {
+
+        struct trace_record* record = &trace->records[index & mask];
+        int chunk = size < TRACE_RECORD_DATA ? size : TRACE_RECORD_DATA;
+
+        /** Readers skip the record from here until the new sequence is stored */
+
+        atomic_store_explicit(&record->sequence, 0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        record->timestamp_ns = timestamp;
+        record->size = chunk;
+        record->direction = direction;
+        record->flags = size > chunk ? TRACE_FLAG_CONTINUED : 0;
+        memcpy(record->data, bytes, chunk);
+
+        atomic_store_explicit(&record->sequence, index + 1, memory_order_release);
+
+        bytes += chunk;
+        size -= chunk;
+    }
+}
+
+/**
+ * Function: trace_write
+ * ----------------------------
+ *  trace_write_at with the time of now, for the reads, which are complete once they return.
+ *  A write is better timed before the call, an echo can be read before the write returns.
+ */
+
+static inline void trace_write(struct uart_trace* trace, int direction, const void* data, ssize_t size) {
+
+    if(trace->header != NULL)
+        trace_write_at(trace, direction, data, size, trace_clock_ns(CLOCK_MONOTONIC));
+}
+
+/**
+ * Function: trace_read
+ * ----------------------------
+ *  Copy a record of the trace.
+ *      @param[in] trace Trace
+ *      @param[in] index Index of the record, from 0 up to the head
+ *      @param[out] record Copy of the record
+ *
+ *      @return 1 if the copy is the complete record of the index, 0 if it was overwritten or
+ *      still being written
+ */
+
+static inline int trace_read(struct uart_trace* trace, uint64_t index, struct trace_record* record) {
+
+    struct trace_record* source = &trace->records[index & (trace->header->record_count - 1)];
+
+    if(atomic_load_explicit(&source->sequence, memory_order_acquire) != index + 1)
+        return 0;
+
+    record->timestamp_ns = source->timestamp_ns;
+    record->size = source->size;
+    record->direction = source->direction;
+    record->flags = source->flags;
+    memcpy(record->data, source->data, TRACE_RECORD_DATA);
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&source->sequence, memory_order_relaxed) == index + 1 && record->size <= TRACE_RECORD_DATA;
+}
+
+/**
+ * Function: trace_pending
+ * ----------------------------
+ *  Whether a record below the head is reserved but not published yet, its writer is still
+ *  filling it and it can be read soon. An overwritten record is not pending.
+ *      @param[in] trace Trace
+ *      @param[in] index Index of the record
+ */
+
+static inline int trace_pending(struct uart_trace* trace, uint64_t index) {
+
+    struct trace_record* source = &trace->records[index & (trace->header->record_count - 1)];
+    return atomic_load_explicit(&source->sequence, memory_order_acquire) < index + 1;
+}